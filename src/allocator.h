@@ -1,85 +1,465 @@
 #ifndef _FILE_SYSTEM_ALLOCATOR_H
 #define _FILE_SYSTEM_ALLOCATOR_H
 
+#include <atomic>
+#include <mutex>
+
+#include "dirty_records.h"
+#include "format.h"
+#include "image.h"
 #include "utility.h"
 
+/**
+ * Class managing free indexes of inodes or memory blocks.
+ *
+ * Allocator keeps a packed bitmap of free indexes, 64 of
+ * them per word, with a summary level marking words which
+ * still have any free index. Searching for free space costs
+ * two count-trailing-zeros instructions per 4096 indexes and
+ * the number of free indexes is kept up to date on every change.
+ * Legacy images store one '0'/'1' character per index and wide
+ * images store the bits themselves; either way the bitmap is
+ * converted from the image at load and every change is stored
+ * back into it.
+ *
+ * Single indexes are handed out from per-thread magazines: all free
+ * indexes of a bitmap word are taken out of the bitmap at once and
+ * given away one by one without taking the lock, so consecutive
+ * allocations neither search the bitmap nor contend. Every thread
+ * uses the magazine of its slot; threads sharing a slot go through
+ * the lock while the magazine is busy. Magazines are refilled and
+ * returned a whole word at a time under the lock. A magazine is
+ * refilled from the word of the hinted index if it is free, so files
+ * extended a block at a time still grow right after their last
+ * blocks, and it goes back into the bitmap only when it holds an
+ * index a range search needs. Indexes in magazines stay free in the
+ * free amount until they are handed out; handed out ones are stored
+ * into the image status at the next refill or write back.
+ *
+ * A magazine is only ever claimed by a thread which either does not
+ * wait for the lock while holding it or holds the lock already, so
+ * claiming it under the lock always succeeds shortly.
+ */
 class Allocator {
 
 private:
 
-    uint16_t size;
-    uint16_t first_free;
-    vec_c    status;
+    static const ui word_bits      = 64;
+    static const ui magazine_slots = 16;
+
+    using vec_64 = std::vector<uint64_t>;
+
+    struct alignas(64) Magazine {
+
+        std::atomic<bool> busy;
+        uint64_t          free;     // Set bit marks free index taken out of the bitmap.
+        uint64_t          taken;    // Set bit marks index handed out, but not stored yet.
+        index_t           base;     // First index of the word the magazine was taken from.
+
+        Magazine(): busy(false), free(0), taken(0), base(0) {}
+    };
+
+    bool                  packed;
+    index_t               size;
+    byte*                 status;       // Mapped status; '1' character or set bit marks free index.
+    std::mutex            lock;         // Guards all members below but the free amount.
+    Dirty_Records         dirty;
+    vec_64                words;        // Set bit marks free index.
+    vec_64                summary;      // Set bit marks word with any free index.
+    std::atomic<index_t>  free_amount;
+    std::vector<Magazine> magazines;
+
+    // Gives slot of the calling thread; threads are given slots in turns.
+    static ui thread_slot() {
+
+        static std::atomic<ui> next(0);
+        thread_local ui        slot = next++ % magazine_slots;
+
+        return slot;
+    }
+
+    static void claim(Magazine& m) {
+        while (m.busy.exchange(true, std::memory_order_acquire));
+    }
+
+    static void release(Magazine& m) {
+        m.busy.store(false, std::memory_order_release);
+    }
+
+    static ui count_trailing_zeros(uint64_t word) {
+        return __builtin_ctzll(word);
+    }
+
+    bool is_free(index_t idx) const {
+        return words[idx / word_bits] >> (idx % word_bits) & 1;
+    }
+
+    void set_free(index_t idx) {
+
+        ui w = idx / word_bits;
+
+        words[w]               |= (uint64_t) 1 << (idx % word_bits);
+        summary[w / word_bits] |= (uint64_t) 1 << (w % word_bits);
+        free_amount++;
+    }
+
+    void set_used(index_t idx) {
+
+        ui w = idx / word_bits;
+
+        words[w] &= ~((uint64_t) 1 << (idx % word_bits));
+
+        if (!words[w])
+            summary[w / word_bits] &= ~((uint64_t) 1 << (w % word_bits));
+
+        free_amount--;
+    }
+
+    // Converts on-disk status into the bitmap.
+    // Packed status is gathered into words a byte at a time.
+    void load_status() {
+
+        if (!packed) {
+
+            for (index_t i = 0; i < size; i++)
+                if (status[i] == '1')
+                    set_free(i);
 
-    uint16_t find_first_free() {
+            return;
+        }
 
-        for (uint16_t i = 0; i < size; i++)
-            if (status[i] == '1')
-                return i;
+        for (std::size_t i = 0; i < ((std::size_t) size + 7) / 8; i++)
+            words[i / 8] |= (uint64_t) status[i] << 8 * (i % 8);
+
+        if (size % word_bits)
+            words.back() &= ((uint64_t) 1 << size % word_bits) - 1;
+
+        for (ui w = 0; w < words.size(); w++) {
+
+            if (!words[w])
+                continue;
+
+            summary[w / word_bits] |= (uint64_t) 1 << (w % word_bits);
+            free_amount            += __builtin_popcountll(words[w]);
+        }
+    }
+
+    // Converts single bitmap entry back into on-disk status.
+    void store_status(index_t idx) {
+
+        if (!packed) {
+            status[idx] = is_free(idx) ? '1' : '0';
+            dirty.mark(idx);
+            return;
+        }
+
+        byte bit = 1 << (idx % 8);
+
+        if (is_free(idx))
+            status[idx / 8] |= bit;
+        else
+            status[idx / 8] &= ~bit;
+
+        dirty.mark(idx / 8);
+    }
+
+    // Counts free indexes following idx (inclusive), up to max.
+    index_t free_run_length(index_t idx, index_t max) const {
+
+        ui length = 0;
+
+        while (length < max && idx + length < size) {
+
+            index_t  i    = idx + length;
+            uint64_t used = ~(words[i / word_bits] >> (i % word_bits));
+            ui       run  = used ? count_trailing_zeros(used) : word_bits;
+
+            run = std::min(run, word_bits - i % word_bits);
+
+            if (!run)
+                break;
+
+            length += run;
+        }
+
+        return std::min(length, (ui) max);
+    }
+
+    index_t find_first_free() const {
+
+        for (ui s = 0; s < summary.size(); s++) {
+
+            if (!summary[s])
+                continue;
+
+            index_t w = s * word_bits + count_trailing_zeros(summary[s]);
+
+            return w * word_bits + count_trailing_zeros(words[w]);
+        }
 
         return size;
     }
 
-    uint16_t free_blocks_amount() const {
+    // Hands out the hinted index of the claimed magazine if it holds
+    // it, its lowest free index otherwise. It gives 0 if it is empty.
+    index_t pop(Magazine& m, index_t hint) {
+
+        if (!m.free)
+            return 0;
+
+        uint64_t bit = m.free & -m.free;
+
+        if (hint - m.base < word_bits && m.free >> (hint - m.base) & 1)
+            bit = (uint64_t) 1 << (hint - m.base);
+
+        m.free  ^= bit;
+        m.taken |= bit;
+        free_amount--;
+
+        return m.base + count_trailing_zeros(bit);
+    }
+
+    // Stores indexes handed out from the claimed magazine into the status.
+    void store_taken(Magazine& m) {
+
+        for (; m.taken; m.taken &= m.taken - 1)
+            store_status(m.base + count_trailing_zeros(m.taken));
+    }
+
+    // Puts indexes left in the claimed magazine back into the
+    // bitmap and stores these handed out.
+    void return_magazine(Magazine& m) {
+
+        store_taken(m);
+
+        if (!m.free)
+            return;
+
+        ui w = m.base / word_bits;
+
+        words[w]               |= m.free;
+        summary[w / word_bits] |= (uint64_t) 1 << (w % word_bits);
+        m.free                  = 0;
+    }
+
+    // Self-explaining.
+    void return_magazines(const Magazine* claimed = nullptr) {
+
+        for (auto& m : magazines) {
+
+            if (&m == claimed)
+                continue;
+
+            claim(m);
+            return_magazine(m);
+            release(m);
+        }
+    }
+
+    // Returns magazines taken from the word of the index. Bases
+    // change only under the lock, so they are read without claims.
+    void return_magazines_of(index_t idx) {
 
-        uint16_t amount = 0;
+        for (auto& m : magazines) {
 
-        for (uint16_t i = first_free; i < size; i++)
-            if (status[i] == '1')
-                amount++;
+            if (idx - m.base >= word_bits)
+                continue;
 
-        return amount;
+            claim(m);
+            return_magazine(m);
+            release(m);
+        }
     }
 
+    // Refills the claimed magazine with all free indexes of the word of
+    // the hint if it has any, of the first word having any otherwise.
+    // If the bitmap has none, magazines of other threads are returned first.
+    void refill_magazine(Magazine& m, index_t hint) {
+
+        return_magazine(m);
+
+        index_t from = hint && hint < size && is_free(hint) ? hint : find_first_free();
+
+        if (from == size) {
+            return_magazines(&m);
+            from = find_first_free();
+        }
+
+        if (from == size)
+            return;
+
+        ui w = from / word_bits;
+
+        m.free = words[w];
+        m.base = w * word_bits;
+
+        words[w]                = 0;
+        summary[w / word_bits] &= ~((uint64_t) 1 << (w % word_bits));
+    }
+
+    void mark_used(index_t idx) {
+
+        if (idx >= size || !is_free(idx))
+            throw std::runtime_error("Trying to corrupt used block");
+
+        set_used(idx);
+        store_status(idx);
+    }
 
 public:
-    explicit Allocator(std::ifstream& f) {
-        size       = read_uint16_t(f);
-        status     = read_string(f, size);
-        first_free = find_first_free();
+    explicit Allocator(Image_Cursor& c, const Format& format):
+            packed(format.packed_status), size(read_uint(c.take(format.index_bytes), format.index_bytes)),
+            status(c.take(format.status_bytes(size))), dirty(format.status_bytes(size)),
+            words(((std::size_t) size + word_bits - 1) / word_bits, 0),
+            summary((words.size() + word_bits - 1) / word_bits, 0), free_amount(0), magazines(magazine_slots) {
+
+        load_status();
     }
 
-    uint16_t get_size() const {
+    index_t get_size() const {
         return size;
     }
 
-    uint16_t get_free_index() {
+    // Function hands out a free index from the thread magazine and
+    // marks it as used. The hinted index is preferred, so files can
+    // grow in place; if the magazine does not hold it but the bitmap
+    // does, the magazine is refilled from its word. The lock is taken
+    // only then and if the magazine is empty or busy. It gives 0 if
+    // there is no free index left.
+    index_t take_free_index(index_t hint = 0) {
+
+        Magazine& m = magazines[thread_slot()];
+
+        if (!m.busy.exchange(true, std::memory_order_acquire)) {
 
-        while (first_free < size && status[first_free] != '1')
-            first_free++;
+            bool    held = hint - m.base < word_bits || !hint;
+            index_t idx  = held ? pop(m, hint) : 0;
 
-        return first_free == size ? 0 : first_free;
+            release(m);
+
+            if (idx)
+                return idx;
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        claim(m);
+
+        if (hint && hint < size && is_free(hint))
+            refill_magazine(m, hint);
+
+        index_t idx = pop(m, hint);
+
+        if (!idx) {
+            refill_magazine(m, hint);
+            idx = pop(m, hint);
+        }
+
+        release(m);
+
+        return idx;
     }
 
-    void mark_as_used(uint16_t idx) {
+    // Function finds contiguous range of at most count free indexes
+    // and marks it as used, searching the bitmap under the lock.
+    // Range starting at hint is preferred, so files can grow
+    // in place; otherwise range begins at the first free index.
+    // Magazines are returned only if one holds the hint or the
+    // bitmap has no free index left. Range ends where a magazine
+    // holds the next index; the next search starting there
+    // returns it. Returned range is empty if there is no free
+    // index left.
+    Extent take_free_range(index_t hint, index_t count) {
 
-        if (status[idx] == 0)
-            throw std::runtime_error("Trying to corrupt used block");
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (hint && hint < size && !is_free(hint))
+            return_magazines_of(hint);
+
+        index_t first = hint && hint < size && is_free(hint) ? hint : find_first_free();
+
+        if (first == size) {
+            return_magazines();
+            first = find_first_free();
+        }
 
-        status[idx] = '0';
+        if (first == size)
+            return {0, 0};
+
+        Extent range{first, free_run_length(first, count)};
+
+        for (index_t i = 0; i < range.length; i++)
+            mark_used(range.start + i);
+
+        return range;
     }
 
-    void dump_allocator_to_file(std::ofstream& f) {
-        write_uint16_t(f, size);
-        write_string(f, status, size);
+    index_t get_free_amount() const {
+        return free_amount;
     }
 
-    void free(uint16_t idx) {
+    // Reports modified status bytes to the image,
+    // including indexes handed out from magazines.
+    void write_back(Image& image) {
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        for (auto& m : magazines) {
+            claim(m);
+            store_taken(m);
+            release(m);
+        }
+
+        for (auto idx : dirty.get_indexes())
+            image.mark_dirty(status + idx, 1);
+
+        dirty.clear();
+    }
+
+    void free(index_t idx) {
+
+        std::lock_guard<std::mutex> guard(lock);
 
         if (idx == 0 || idx >= size)
             throw std::runtime_error("Trying to release unavailable block");
 
-        if (status[idx] == '1')
+        if (is_free(idx))
             throw std::runtime_error("Trying to release free memory block");
 
-        status[idx] = '1';
-        first_free  = std::min(first_free, idx);
+        set_free(idx);
+        store_status(idx);
     }
 
-    void info() const {
-        std::cout << "Blocks in total: " << size << ". Free blocks: " << free_blocks_amount() << std::endl;
+    // Frees the whole range at once, a bitmap word at a time.
+    void free_range(const Extent& range) {
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (!range.start || (std::size_t) range.start + range.length > size)
+            throw std::runtime_error("Trying to release unavailable block");
+
+        for (index_t i = range.start; i < range.start + range.length; ) {
+
+            ui       w    = i / word_bits;
+            ui       bits = std::min<index_t>(word_bits - i % word_bits, range.start + range.length - i);
+            uint64_t mask = (bits == word_bits ? ~(uint64_t) 0 : ((uint64_t) 1 << bits) - 1) << (i % word_bits);
+
+            if (words[w] & mask)
+                throw std::runtime_error("Trying to release free memory block");
+
+            words[w]               |= mask;
+            summary[w / word_bits] |= (uint64_t) 1 << (w % word_bits);
+            free_amount            += bits;
+            i                      += bits;
+        }
+
+        for (index_t i = range.start; i < range.start + range.length; i++)
+            store_status(i);
     }
 
+    void info(std::ostream& out) const {
+        out << "Blocks in total: " << size << ". Free blocks: " << free_amount << '\n';
+    }
 
 };
 
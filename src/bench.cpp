@@ -0,0 +1,159 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "file_system.h"
+
+// Benchmark of allocating inodes and blocks from many threads.
+//
+// First every thread takes its share of inode indexes from one
+// allocator, straight from the per-thread magazines and then from
+// the plain bitmap: the first free index is searched for and marked
+// as used under a lock shared by all threads, as File_System did under
+// its state lock.
+//
+// Then every thread creates its share of files in its own directory
+// and appends to each of them content taking a few blocks, so every
+// operation takes indexes from both allocators, outside of the state
+// lock. Commits do not wait for the journal, so syncing it does not
+// hide the allocations.
+
+static const ui max_threads = 8;
+static const ui files       = 1 << 15;
+
+using steady_clock = std::chrono::steady_clock;
+
+// Gives millions of indexes handed out per second.
+template <typename F>
+static double take_indexes(Allocator& allocator, ui threads, ui per_thread, F take) {
+
+    std::vector<vec_i>       taken(threads);
+    std::vector<std::thread> workers;
+    auto                     start = steady_clock::now();
+
+    for (ui t = 0; t < threads; t++)
+        workers.emplace_back([&, t] {
+
+            taken[t].reserve(per_thread);
+
+            for (ui i = 0; i < per_thread; i++)
+                taken[t].push_back(take());
+        });
+
+    for (auto& w : workers)
+        w.join();
+
+    double seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+    for (auto const& indexes : taken)
+        for (auto idx : indexes) {
+
+            if (!idx)
+                throw std::runtime_error("Allocator ran out of indexes");
+
+            allocator.free(idx);
+        }
+
+    return threads * per_thread / seconds / 1e6;
+}
+
+static void bench_allocator(const std::string& name) {
+
+    File_System_Manager::make_empty_file_system(name, 1 << 26, Format::default_block_size);
+
+    Image        image(name, true);
+    Image_Cursor cursor(image);
+    Format       format = Format::read(cursor);
+    Allocator    allocator(cursor, format);
+    std::mutex   lock;
+    ui           per_thread = (allocator.get_free_amount() - 64 * max_threads) / max_threads;
+
+    std::cout << "Indexes per thread: " << per_thread << '\n'
+              << std::setw(8) << "Threads" << std::setw(16) << "Magazines" << std::setw(16) << "Bitmap + lock"
+              << "   (millions of indexes per second)\n";
+
+    for (ui threads = 1; threads <= max_threads; threads *= 2) {
+
+        double magazines = take_indexes(allocator, threads, per_thread, [&] {
+            return allocator.take_free_index();
+        });
+
+        double locked = take_indexes(allocator, threads, per_thread, [&] {
+
+            std::lock_guard<std::mutex> guard(lock);
+
+            return allocator.take_free_range(0, 1).start;
+        });
+
+        std::cout << std::setw(8) << threads << std::setw(16) << magazines << std::setw(16) << locked << '\n';
+    }
+}
+
+// Gives thousands of files created and extended per second.
+static double run(const std::string& name, ui threads) {
+
+    File_System_Manager::make_empty_file_system(name, 1 << 26, Format::default_block_size);
+
+    Image                    image(name, true);
+    File_System              system(image);
+    std::vector<std::thread> workers;
+    std::string              content(150, 'x');
+
+    for (ui t = 0; t < threads; t++)
+        system.mkdir({}, "d" + std::to_string(t));
+
+    auto start = steady_clock::now();
+
+    for (ui t = 0; t < threads; t++)
+        workers.emplace_back([&, t] {
+
+            std::string dir = "d" + std::to_string(t);
+
+            for (ui i = 0; i < files / threads; i++) {
+
+                std::string file = "f" + std::to_string(i);
+
+                system.add_file({dir}, file);
+                system.write_to_file({dir}, file, content);
+            }
+        });
+
+    for (auto& w : workers)
+        w.join();
+
+    double seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+    return files / threads * threads / seconds / 1e3;
+}
+
+int main(int argc, char** argv){
+
+    std::string name = argc > 1 ? argv[1] : "bench.img";
+    bool        ok   = true;
+
+    try {
+
+        std::cout << std::fixed << std::setprecision(2);
+        bench_allocator(name);
+
+        std::cout << "\nFiles: " << files << '\n' << std::setw(8) << "Threads" << std::setw(16) << "Files / s"
+                  << "   (thousands of files created and extended per second)\n";
+
+        for (ui threads = 1; threads <= max_threads; threads *= 2)
+            std::cout << std::setw(8) << threads << std::setw(16) << run(name, threads) << '\n';
+
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        ok = false;
+    }
+
+    unlink(name.c_str());
+    unlink(Image::journal_name(name).c_str());
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+#ifndef _FILE_SYSTEM_COMMAND_LINE_H
+#define _FILE_SYSTEM_COMMAND_LINE_H
+
+#include <istream>
+#include <string>
+#include <string_view>
+
+#include "utility.h"
+
+/**
+ * Tokenizer of command lines.
+ *
+ * Every line is read into one buffer reused for the whole
+ * session. Tokens, as well as components of paths given
+ * in the line, are views into this buffer and paths are
+ * split into vectors which are reused as well, so parsing
+ * a command does not allocate memory.
+ */
+class Command_Line {
+
+public:
+
+    static const ui max_paths = 2;
+
+private:
+
+    std::string      buffer;
+    std::string_view remaining;        // Part of the line not tokenized yet.
+    path_v           paths[max_paths]; // Directories of paths given in the line.
+
+    static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    void skip_spaces() {
+
+        std::size_t i = 0;
+
+        while (i < remaining.size() && is_space(remaining[i]))
+            i++;
+
+        remaining.remove_prefix(i);
+    }
+
+public:
+
+    // Function reads next non-blank line. It gives false at the end of input.
+    bool read(std::istream& in) {
+
+        while (std::getline(in, buffer)) {
+
+            remaining = buffer;
+            skip_spaces();
+
+            if (!remaining.empty())
+                return true;
+        }
+
+        return false;
+    }
+
+    // Function takes text as the line to tokenize.
+    // It gives false if the line is blank.
+    bool assign(std::string_view text) {
+
+        buffer.assign(text);
+        remaining = buffer;
+        skip_spaces();
+
+        return !remaining.empty();
+    }
+
+    // Function gives next whitespace separated token,
+    // or an empty view if the line has ended.
+    std::string_view next_token() {
+
+        skip_spaces();
+
+        std::size_t end = 0;
+
+        while (end < remaining.size() && !is_space(remaining[end]))
+            end++;
+
+        auto token = remaining.substr(0, end);
+        remaining.remove_prefix(end);
+
+        return token;
+    }
+
+    // Function gives the rest of the line, without the
+    // single character separating it from the last token.
+    std::string_view rest() {
+
+        auto r = remaining.empty() ? remaining : remaining.substr(1);
+        remaining = std::string_view();
+
+        return r;
+    }
+
+    // Function takes next token as a path. Directories leading
+    // to the file are kept in the given slot and name of the file
+    // is returned. Path / names the root directory itself.
+    std::string_view next_path(ui slot) {
+
+        auto  token = next_token();
+        auto& path  = paths[slot];
+
+        path.clear();
+
+        if (token == "/")
+            return token;
+
+        for (std::size_t pos; (pos = token.find('/')) != std::string_view::npos; ) {
+            path.push_back(token.substr(0, pos));
+            token.remove_prefix(pos + 1);
+        }
+
+        return token;
+    }
+
+    const path_v& get_path(ui slot) const {
+        return paths[slot];
+    }
+
+};
+
+#endif //_FILE_SYSTEM_COMMAND_LINE_H
@@ -0,0 +1,375 @@
+#ifndef _FILE_SYSTEM_DAEMON_H
+#define _FILE_SYSTEM_DAEMON_H
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include "command_line.h"
+#include "file_system.h"
+
+/**
+ * Daemon serving one file system to many local clients.
+ *
+ * The image is loaded once and clients connect to a Unix domain
+ * socket, sending commands in the grammar of File_System_Manager,
+ * one per line. Output and error messages of every command are sent
+ * back to the client which gave it; quit closes the connection.
+ *
+ * One thread waits for connections and incoming data with epoll
+ * and hands clients which sent data to a fixed pool of workers.
+ * Connections are registered one-shot, so every client is served
+ * by one worker at a time and its commands run in order, while
+ * commands of different clients run in parallel as far as
+ * File_System allows. SIGINT or SIGTERM stop the daemon.
+ *
+ * Output the connection does not take at once is kept with the client
+ * and its connection is watched for writing instead, so no worker waits
+ * for a client which stops reading. Commands of the client are not read
+ * until all of its output is sent.
+ */
+class File_System_Daemon {
+
+private:
+
+    static const ui max_events   = 64;
+    static const ui receive_size = 1 << 16;
+
+    // Connection of a client along with its unfinished input and output.
+    struct Client {
+
+        int          fd;
+        std::string  input;     // Received bytes not ending with a new line yet.
+        std::string  output;    // Output not sent yet.
+        bool         closing;   // Session has ended; connection is closed once output is sent.
+        Command_Line line;
+    };
+
+    using client_m = std::unordered_map<int, std::unique_ptr<Client>>;
+
+    File_System&             system;
+    std::string              path;
+    int                      listener;
+    int                      signals;
+    int                      events;
+    bool                     stopping;
+
+    std::mutex               lock;          // Guards clients, ready and stopping.
+    std::condition_variable  wake;
+    client_m                 clients;
+    std::deque<Client*>      ready;         // Clients which sent data, waiting for a worker.
+    std::vector<std::thread> workers;
+
+    // Clients are watched for writing while they have output left.
+    void watch(int fd, int operation, bool sending = false) {
+
+        epoll_event event{};
+
+        event.events  = (sending ? EPOLLOUT : EPOLLIN) | (fd == listener || fd == signals ? 0 : EPOLLONESHOT);
+        event.data.fd = fd;
+
+        if (epoll_ctl(events, operation, fd, &event) < 0)
+            throw std::runtime_error("Unable to watch daemon connection");
+    }
+
+    // Stale socket left by a daemon which did not stop cleanly is
+    // replaced. It is stale only if connecting to it is refused; a socket
+    // some daemon listens on and any other existing file are left untouched.
+    void remove_stale_socket(const sockaddr_un& address) const {
+
+        struct stat existing;
+
+        if (stat(path.c_str(), &existing) || !S_ISSOCK(existing.st_mode))
+            return;
+
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (probe < 0)
+            throw std::runtime_error("Unable to listen on socket");
+
+        bool refused = connect(probe, (const sockaddr*) &address, sizeof(address)) < 0 && errno == ECONNREFUSED;
+
+        close(probe);
+
+        if (!refused)
+            throw std::runtime_error("Socket is already in use");
+
+        unlink(path.c_str());
+    }
+
+    void listen_on_socket() {
+
+        sockaddr_un address{};
+
+        if (path.size() >= sizeof(address.sun_path))
+            throw std::runtime_error("Socket path is too long");
+
+        address.sun_family = AF_UNIX;
+        path.copy(address.sun_path, path.size());
+
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        remove_stale_socket(address);
+
+        if (listener < 0 || bind(listener, (const sockaddr*) &address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0)
+            throw std::runtime_error("Unable to listen on socket");
+    }
+
+    // Signals stopping the daemon are received through a descriptor.
+    // They are blocked before workers start, so workers inherit the mask.
+    void catch_signals() {
+
+        sigset_t mask;
+
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+        signals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+        if (signals < 0)
+            throw std::runtime_error("Unable to catch signals");
+    }
+
+    void accept_clients() {
+
+        while (true) {
+
+            int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+            if (fd < 0 && errno == EINTR)
+                continue;
+
+            if (fd < 0)
+                return;
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                clients[fd] = std::unique_ptr<Client>(new Client{fd, {}, {}, false, {}});
+            }
+
+            watch(fd, EPOLL_CTL_ADD);
+        }
+    }
+
+    void schedule(int fd) {
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        auto client = clients.find(fd);
+
+        if (client != clients.end()) {
+            ready.push_back(client->second.get());
+            wake.notify_one();
+        }
+    }
+
+    // Sends as much of the output of the client as the connection
+    // takes without waiting. It gives false if the client is gone.
+    static bool send_output(Client& client) {
+
+        std::size_t done = 0;
+
+        while (done < client.output.size()) {
+
+            ssize_t sent = send(client.fd, client.output.data() + done, client.output.size() - done, MSG_NOSIGNAL);
+
+            if (sent < 0 && errno == EINTR)
+                continue;
+
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+
+            if (sent < 0)
+                return false;
+
+            done += sent;
+        }
+
+        client.output.erase(0, done);
+
+        return true;
+    }
+
+    // Function executes the line of the client.
+    // It gives false if the line ends the session.
+    bool execute(Client& client, std::string_view text, std::ostream& out) {
+
+        if (!client.line.assign(text))
+            return true;
+
+        return File_System_Manager::execute_command(system, client.line, out, out);
+    }
+
+    // Function sends output left from before; once all of it is sent,
+    // it receives everything the client has sent, executes all whole
+    // lines and sends back their output. Once the client closes its
+    // end, the last line is executed even without a new line.
+    // It gives false if the connection is to be closed.
+    bool serve(Client& client) {
+
+        static thread_local char buffer[receive_size];
+
+        if (!send_output(client))
+            return false;
+
+        if (!client.output.empty())
+            return true;
+
+        if (client.closing)
+            return false;
+
+        bool ended = false;
+
+        while (!ended) {
+
+            ssize_t got = recv(client.fd, buffer, receive_size, 0);
+
+            if (got > 0)
+                client.input.append(buffer, got);
+            else if (got < 0 && errno == EINTR)
+                continue;
+            else if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            else
+                ended = true;
+        }
+
+        std::ostringstream out;
+        std::size_t        start = 0;
+        std::size_t        end;
+        bool               open  = true;
+
+        while (open && (end = client.input.find('\n', start)) != std::string::npos) {
+            open  = execute(client, std::string_view(client.input).substr(start, end - start), out);
+            start = end + 1;
+        }
+
+        client.input.erase(0, start);
+
+        if (open && ended && !client.input.empty())
+            execute(client, client.input, out);
+
+        client.output  += out.str();
+        client.closing  = !open || ended;
+
+        return send_output(client) && (!client.closing || !client.output.empty());
+    }
+
+    void work() {
+
+        std::unique_lock<std::mutex> guard(lock);
+
+        while (true) {
+
+            wake.wait(guard, [this] { return stopping || !ready.empty(); });
+
+            if (stopping)
+                return;
+
+            Client* client = ready.front();
+            ready.pop_front();
+
+            guard.unlock();
+            bool open = serve(*client);
+            guard.lock();
+
+            if (open)
+                watch(client->fd, EPOLL_CTL_MOD, !client->output.empty());
+            else {
+                int fd = client->fd;
+                clients.erase(fd);
+                close(fd);
+            }
+        }
+    }
+
+public:
+    explicit File_System_Daemon(File_System& fs, const std::string& socket_path, ui worker_count):
+            system(fs), path(socket_path), listener(-1), signals(-1), events(-1), stopping(false) {
+
+        listen_on_socket();
+        catch_signals();
+
+        events = epoll_create1(EPOLL_CLOEXEC);
+
+        if (events < 0)
+            throw std::runtime_error("Unable to create event loop");
+
+        watch(listener, EPOLL_CTL_ADD);
+        watch(signals, EPOLL_CTL_ADD);
+
+        for (ui i = 0; i < std::max(worker_count, 1u); i++)
+            workers.emplace_back([this] { work(); });
+    }
+
+    ~File_System_Daemon() {
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            wake.notify_all();
+        }
+
+        for (auto& worker : workers)
+            worker.join();
+
+        for (auto const& client : clients)
+            close(client.first);
+
+        for (int fd : {listener, signals, events})
+            if (fd >= 0)
+                close(fd);
+
+        if (listener >= 0)
+            unlink(path.c_str());
+    }
+
+    // Event loop. It returns once the daemon is asked to stop;
+    // commands being executed by workers are completed first.
+    void run() {
+
+        epoll_event happened[max_events];
+
+        while (true) {
+
+            int n = epoll_wait(events, happened, max_events, -1);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n < 0)
+                throw std::runtime_error("Event loop failed");
+
+            for (int i = 0; i < n; i++) {
+
+                int fd = happened[i].data.fd;
+
+                if (fd == signals)
+                    return;
+
+                if (fd == listener)
+                    accept_clients();
+                else
+                    schedule(fd);
+            }
+        }
+    }
+
+};
+
+#endif //_FILE_SYSTEM_DAEMON_H
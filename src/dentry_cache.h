@@ -0,0 +1,102 @@
+#ifndef _FILE_SYSTEM_DENTRY_CACHE_H
+#define _FILE_SYSTEM_DENTRY_CACHE_H
+
+#include <unordered_map>
+
+#include "utility.h"
+
+/**
+ * Cache of resolved path components.
+ *
+ * Maps pair (parent directory inode, name) onto the inode
+ * the name points to, so resolving a path does not need
+ * to read and decode every directory on the way.
+ * Entries are invalidated whenever the name is added to or
+ * removed from its parent directory. When the cache grows
+ * over its capacity it is simply emptied.
+ * Entries are keyed by the hash of the pair and keep the name
+ * themselves, so looking a name up compares it with the name of
+ * the entry and does not build a key of its own.
+ */
+class Dentry_Cache {
+
+private:
+
+    struct Entry {
+
+        index_t     parent;
+        std::string name;
+        index_t     inode;
+    };
+
+    using entries_m = std::unordered_multimap<std::size_t, Entry>;
+
+    entries_m entries;
+    ui        capacity;
+    ui        hits;
+    ui        misses;
+
+    static std::size_t hash(index_t parent, std::string_view name) {
+        return std::hash<std::string_view>()(name) * 31 + parent;
+    }
+
+    // Function gives entry of the name inside parent or end of entries.
+    entries_m::iterator find(index_t parent, std::string_view name) {
+
+        auto range = entries.equal_range(hash(parent, name));
+
+        for (auto it = range.first; it != range.second; ++it)
+            if (it->second.parent == parent && it->second.name == name)
+                return it;
+
+        return entries.end();
+    }
+
+public:
+    explicit Dentry_Cache(ui cap): capacity(cap), hits(0), misses(0) {}
+
+    // Function gives inode of the name inside parent or 0 on miss.
+    index_t lookup(index_t parent, std::string_view name) {
+
+        auto it = find(parent, name);
+
+        if (it == entries.end()) {
+            misses++;
+            return 0;
+        }
+
+        hits++;
+
+        return it->second.inode;
+    }
+
+    void insert(index_t parent, std::string_view name, index_t inode) {
+
+        auto it = find(parent, name);
+
+        if (it != entries.end()) {
+            it->second.inode = inode;
+            return;
+        }
+
+        if (entries.size() >= capacity)
+            entries.clear();
+
+        entries.emplace(hash(parent, name), Entry{parent, std::string(name), inode});
+    }
+
+    void invalidate(index_t parent, std::string_view name) {
+
+        auto it = find(parent, name);
+
+        if (it != entries.end())
+            entries.erase(it);
+    }
+
+    void info(std::ostream& out) const {
+        out << "Dentry cache hits: " << hits << ". Misses: " << misses << ". Entries: " << entries.size() << '\n';
+    }
+
+};
+
+#endif //_FILE_SYSTEM_DENTRY_CACHE_H
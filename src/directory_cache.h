@@ -0,0 +1,136 @@
+#ifndef _FILE_SYSTEM_DIRECTORY_CACHE_H
+#define _FILE_SYSTEM_DIRECTORY_CACHE_H
+
+#include <list>
+#include <unordered_map>
+
+#include "utility.h"
+
+/**
+ * Cache of decoded directories.
+ *
+ * Keeps decoded Directory objects keyed by their inode, so
+ * directories are decoded once and then mutated in place.
+ * Mutated directories are only marked as dirty; they are
+ * encoded and written back into memory blocks lazily, when
+ * they are evicted or when the whole cache is flushed.
+ * Cache holds at most capacity directories between operations;
+ * least recently used ones are evicted first.
+ */
+class Directory_Cache {
+
+private:
+
+    using lru_l = std::list<index_t>;
+
+    struct Entry {
+
+        Directory       dir;
+        bool            dirty;
+        lru_l::iterator position;
+    };
+
+    using entries_m = std::unordered_map<index_t, Entry>;
+
+    entries_m entries;
+    lru_l     lru;          // Most recently used inodes first.
+    ui        capacity;
+    ui        hits;
+    ui        misses;
+    ui        write_backs;
+
+public:
+    explicit Directory_Cache(ui cap): capacity(cap), hits(0), misses(0), write_backs(0) {}
+
+    // Function gives cached directory or nullptr on miss.
+    Directory* find(index_t inode) {
+
+        auto it = entries.find(inode);
+
+        if (it == entries.end()) {
+            misses++;
+            return nullptr;
+        }
+
+        hits++;
+        lru.splice(lru.begin(), lru, it->second.position);
+
+        return &it->second.dir;
+    }
+
+    // Function gives cached directory without updating statistics or order.
+    const Directory* peek(index_t inode) const {
+
+        auto it = entries.find(inode);
+
+        return it == entries.end() ? nullptr : &it->second.dir;
+    }
+
+    Directory& insert(Directory dir) {
+
+        index_t inode = dir.inode_num;
+
+        lru.push_front(inode);
+
+        return entries.emplace(inode, Entry{std::move(dir), false, lru.begin()}).first->second.dir;
+    }
+
+    void mark_dirty(index_t inode) {
+        entries.at(inode).dirty = true;
+    }
+
+    // Function forgets directory without writing it back.
+    // Used for directories which are being erased.
+    void drop(index_t inode) {
+
+        auto it = entries.find(inode);
+
+        if (it == entries.end())
+            return;
+
+        lru.erase(it->second.position);
+        entries.erase(it);
+    }
+
+    // Function writes back all dirty directories.
+    template <typename Write_Back>
+    void flush(Write_Back write_back) {
+
+        for (auto& entry : entries) {
+
+            if (!entry.second.dirty)
+                continue;
+
+            write_back(entry.second.dir);
+            entry.second.dirty = false;
+            write_backs++;
+        }
+    }
+
+    // Function evicts least recently used directories until
+    // the cache fits into its capacity; dirty ones are written back.
+    template <typename Write_Back>
+    void trim(Write_Back write_back) {
+
+        while (entries.size() > capacity) {
+
+            auto it = entries.find(lru.back());
+
+            if (it->second.dirty) {
+                write_back(it->second.dir);
+                write_backs++;
+            }
+
+            lru.pop_back();
+            entries.erase(it);
+        }
+    }
+
+    void info(std::ostream& out) const {
+        out << "Directory cache hits: " << hits << ". Misses: " << misses
+            << ". Entries: " << entries.size() << ". Write-backs: " << write_backs << '\n';
+    }
+
+};
+
+#endif //_FILE_SYSTEM_DIRECTORY_CACHE_H
@@ -0,0 +1,47 @@
+#ifndef _FILE_SYSTEM_DIRTY_RECORDS_H
+#define _FILE_SYSTEM_DIRTY_RECORDS_H
+
+#include "utility.h"
+
+/**
+ * Class remembering modified records.
+ *
+ * Every structure stored in the image keeps one of these
+ * in order to know which of its fixed size records have
+ * changed since the last save. Only those records are
+ * later written back into the image file.
+ */
+class Dirty_Records {
+
+private:
+
+    std::vector<bool> marked;
+    std::vector<ui>   indexes;  // Marked records in order of the first change.
+
+public:
+    explicit Dirty_Records(ui size): marked(size, false) {}
+
+    void mark(ui idx) {
+
+        if (marked[idx])
+            return;
+
+        marked[idx] = true;
+        indexes.push_back(idx);
+    }
+
+    const std::vector<ui>& get_indexes() const {
+        return indexes;
+    }
+
+    void clear() {
+
+        for (auto idx : indexes)
+            marked[idx] = false;
+
+        indexes.clear();
+    }
+
+};
+
+#endif //_FILE_SYSTEM_DIRTY_RECORDS_H
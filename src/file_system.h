@@ -1,11 +1,26 @@
 #ifndef _FILE_SYSTEM_FILE_SYSTEM_H
 #define _FILE_SYSTEM_FILE_SYSTEM_H
 
+#include <charconv>
+#include <chrono>
 #include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
 #include "allocator.h"
+#include "command_line.h"
+#include "dentry_cache.h"
+#include "directory_cache.h"
+#include "format.h"
+#include "image.h"
 #include "inodes.h"
 #include "utility.h"
 #include "memory_blocks.h"
+#include "subtree_sizes.h"
 
 /**
  * Top class managing file system.
@@ -13,86 +28,469 @@
  * Class gathers all utilities provided by single
  * file system classes (such as Memory_BLocks/Inodes) and
  * binds them all together in order to manage file system stored on file.
+ *
+ * Public operations may be called from many threads. Locks are
+ * always taken in this order, each of them at most once:
+ *
+ *  1. tree_lock   - exclusive for erase and sync, shared for all
+ *                   the others;
+ *  2. inode lock  - one of inode_lock_stripes shared mutexes guarding
+ *                   content of an inode; shared while the content is
+ *                   copied out, exclusive while it is changed;
+ *  3. state_lock  - guards caches, lazily mapped inodes, subtree sizes
+ *                   and dirty records, which reads update too.
+ *
+ * Allocators guard themselves. Inode and first block of a new file are
+ * taken before the state lock and blocks extending a file while it is
+ * released, so most of them come from per-thread magazines of the
+ * allocators and allocations of different threads do not serialize.
+ *
+ * State lock is released while an inode lock is awaited and is not
+ * held while file content is copied in or out, so reads and writes
+ * of different files proceed in parallel. Directories are changed by
+ * touch, mkdir and link, and missing ones on paths are created, under
+ * the state lock only, so these run next to reads and writes as well.
+ * Erase still stops all other operations, as it frees blocks of files
+ * which others might be copying.
+ *
+ * Every operation changing the file system logs the records it modified
+ * into the journal of the image while it still holds its locks and
+ * returns once they are synced; the journal writes transactions of
+ * many operations at once. Cached
+ * directories are not written back for it; changes of their entries
+ * are logged instead and applied again when the image is loaded.
  */
 class File_System {
 
 private:
-    Allocator     inodes_allocator;
-    Inodes        inodes;
-    Allocator     memory_allocator;
-    Memory_Blocks memory;
+    Image&                         image;
+    const Format                   format;
+    Allocator                      inodes_allocator;
+    Inodes                         inodes;
+    Allocator                      memory_allocator;
+    std::unique_ptr<Memory_Blocks> memory;
+    Dentry_Cache                   dentries;
+    Directory_Cache                directories;
+    Subtree_Sizes                  subtrees;
+    std::string                    last_path;        // Components of the path resolved by the previous
+                                                     // operation, each followed by '/'.
+    index_t                        last_directory;   // Directory the last path leads to.
+
+    static const ui inode_lock_stripes = 64;
+
+    std::shared_mutex tree_lock;
+    std::shared_mutex inode_locks[inode_lock_stripes];  // Inode n is guarded by stripe n % inode_lock_stripes.
+    std::mutex        state_lock;
+
+    /**
+     * Inode and first memory block of a file to be created. They are
+     * taken from the allocators on construction and given back on
+     * destruction unless the file has been created with them.
+     */
+    struct New_File {
+
+        Allocator& inodes_allocator;
+        Allocator& memory_allocator;
+        index_t    inode;
+        index_t    block;
+
+        New_File(Allocator& i, Allocator& m):
+                inodes_allocator(i), memory_allocator(m), inode(i.take_free_index()), block(m.take_free_index()) {}
+
+        ~New_File() {
+
+            if (inode)
+                inodes_allocator.free(inode);
+
+            if (block)
+                memory_allocator.free(block);
+        }
+    };
+
+    // Function makes sure the in-memory part of the inode
+    // (extents, length, blocks amount and last block) is known.
+    // Inodes used for the first time are mapped by walking
+    // their block list once.
+    void map_inode(index_t inode) {
+
+        if (inodes.is_inode_mapped(inode))
+            return;
+
+        auto extents = memory->map_extents(inodes.get_inode_mem_block(inode));
+        auto length  = inodes.is_length_stored() ? inodes.get_stored_length(inode) : memory->content_length(extents);
+
+        inodes.map_inode(inode, std::move(extents), length);
+    }
+
+    // Self-explaining.
+    const extent_v& get_extents(index_t inode) {
+
+        map_inode(inode);
+
+        return inodes.get_extents(inode);
+    }
+
+    // Function gives length of the inode content. Records of wide
+    // images store it, so the block list is walked only for legacy
+    // images; extents are mapped once the content itself is needed.
+    length_t get_file_length(index_t inode) {
+
+        if (!inodes.is_inode_mapped(inode) && inodes.is_length_stored())
+            return inodes.get_stored_length(inode);
+
+        map_inode(inode);
+
+        return inodes.get_length(inode);
+    }
+
+    // Function records new length of the inode content.
+    // Change of a file length is applied to subtree sizes
+    // of all directories counting the file.
+    void set_file_length(index_t inode, length_t length) {
+
+        if (!inodes.is_inode_directory(inode))
+            subtrees.file_changed(inode, (long) length - (long) inodes.get_length(inode));
+
+        inodes.set_length(inode, length);
+    }
+
+    // Function gives amount of bytes which fit into memory blocks of the inode.
+    length_t get_file_capacity(index_t inode) {
+
+        map_inode(inode);
+
+        return (length_t) inodes.get_blocks_amount(inode) * memory->get_memory_block_size();
+    }
+
+    // Self-explaining.
+    vec_c full_content(index_t inode) {
+        return memory->full_file_content(get_extents(inode));
+    }
+
+    // Self-explaining.
+    Directory load_directory(index_t inode) {
+        return Directory(inode, inodes.get_inode_mem_block(inode), format.index_bytes, full_content(inode));
+    }
+
+    // Function gives decoded directory of the inode.
+    // Directories missing in directory cache are
+    // read from memory and cached.
+    Directory& get_directory(index_t inode) {
+
+        Directory* dir = directories.find(inode);
+
+        return dir ? *dir : directories.insert(load_directory(inode));
+    }
+
+    // Self-explaining.
+    void flush_directories() {
+        directories.flush([this](const Directory& dir) { write_back_directory(dir); });
+    }
+
+    // Function applies entry changes found in the journal at load
+    // to directories as they are stored in the image and saves it,
+    // which empties the journal. The image may already hold some
+    // of the changes, if it was saved but the journal was not
+    // emptied, so names already added or erased are skipped.
+    // If the changed directories cannot be written back, the image
+    // is still loaded: they stay cached and the journal is kept.
+    void replay_entries() {
+
+        for (auto const& [inode, changes] : image.take_replayed_entries()) {
+
+            Directory& dir = get_directory(inode);
+
+            for (auto const& change : changes) {
+
+                bool present = dir.get_file_inode(change.name);
+
+                if (change.inode && !present)
+                    dir.add_new_file(change.name, change.inode);
+                else if (!change.inode && present)
+                    dir.erase_file(change.name);
+            }
+
+            mark_directory_dirty(dir);
+        }
+
+        try {
+            sync();
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Unable to save replayed journal; " << e.what() << std::endl;
+            return;
+        }
+
+        trim_directories();
+    }
+
+    // Function evicts directories over the cache capacity.
+    // It is called once an operation no longer holds
+    // references to cached directories.
+    void trim_directories() {
+        directories.trim([this](const Directory& dir) { write_back_directory(dir); });
+    }
+
+    // Function reports all modified records to the image.
+    // Cached directories are left as they are.
+    void write_back() {
+
+        inodes_allocator.write_back(image);
+        inodes.write_back(image);
+        memory_allocator.write_back(image);
+        memory->write_back(image);
+    }
+
+    // Function logs changes of the operation into the journal.
+    // It is called while the operation still holds its locks.
+    // Changed entries of cached directories are already logged
+    // as they happen. It gives number of the logged transaction.
+    uint64_t log_changes() {
+
+        write_back();
+
+        return image.log();
+    }
+
+    // Function logs changes of the operation, releases its locks
+    // and waits until the changes are synced into the journal,
+    // along with these of operations committing at the same time.
+    // Image is saved once the journal grows over journal_limit.
+    template <typename... Locks>
+    void commit(Locks&... locks) {
+
+        uint64_t transaction = log_changes();
+
+        (locks.unlock(), ...);
+
+        image.commit(transaction);
+
+        if (image.journal_size() > journal_limit)
+            sync();
+    }
+
+    // Function gives inode of the name inside parent directory.
+    // Names are looked up in dentry cache first; on miss the
+    // parent directory is read and the result is cached.
+    // If the name does not exist, new directory is created.
+    index_t resolve_name(index_t parent, std::string_view name) {
+
+        index_t inode = dentries.lookup(parent, name);
+
+        if (inode)
+            return inode;
+
+        Directory& dir = get_directory(parent);
+        inode = dir.get_file_inode(name);
+
+        if (!inode) {
+            New_File file(inodes_allocator, memory_allocator);
+            add_new_file_to_directory(dir, name, true, file);
+            mark_directory_dirty(dir);
+            inode = dir.get_file_inode(name);
+        }
+
+        dentries.insert(parent, name, inode);
+
+        return inode;
+    }
+
+    // Function takes the lock of the inode into file. State lock
+    // is released while waiting for it, so the lock order is kept;
+    // directories found before may have left the cache afterwards.
+    template <typename Lock>
+    void lock_inode(Lock& file, index_t inode, std::unique_lock<std::mutex>& state) {
+
+        state.unlock();
+        file = Lock(inode_locks[inode % inode_lock_stripes]);
+        state.lock();
+    }
+
+    // Function checks whether the path is the one resolved by the
+    // previous operation, comparing it with the stored components.
+    bool is_last_path(const path_v& path) const {
+
+        std::string_view rest = last_path;
+
+        for (auto const& s : path) {
+
+            if (rest.size() <= s.size() || rest.compare(0, s.size(), s) || rest[s.size()] != '/')
+                return false;
+
+            rest.remove_prefix(s.size() + 1);
+        }
+
+        return rest.empty();
+    }
 
     // Function seeks for directory specified with path vector.
     // If during traversing file system is stops to find valid
     // directories it will continue to create new directories.
-    Directory find_directory(const vec_s& path) {
-
-        uint16_t inode = 0;
-        uint16_t block = 0;
+    // Only the last directory of the path has to be read, as long
+    // as the components leading to it are present in dentry cache.
+    // Consecutive operations in the same directory, common in
+    // scripts, resolve its path only once. The path is remembered
+    // in one buffer reused by every operation.
+    Directory& find_directory(const path_v& path) {
 
-        auto dir_content = memory.full_file_content(block);
+        if (is_last_path(path))
+            return get_directory(last_directory);
 
-        Directory dir (inode, block, dir_content);
+        index_t inode = 0;
 
         for (auto const& s : path) {
 
-            inode = dir.get_file_inode(s);
-
-            if (!inode) {
-                add_new_file_to_directory(dir, s, true);
-                save_directory_to_memory(dir);
-                inode = dir.get_file_inode(s);
-            }
+            index_t parent = inode;
+            inode = resolve_name(parent, s);
 
             if (!inodes.is_inode_directory(inode))
                 throw std::runtime_error("Incorrect path (found file inside specified path)");
 
-            block       = inodes.get_memory_block(inode);
-            dir_content = memory.full_file_content(block);
-            dir         = Directory(inode, block, dir_content);
+            subtrees.set_parent(inode, parent);
         }
 
-        return dir;
+        last_path.clear();
+
+        for (auto const& s : path)
+            last_path.append(s).push_back('/');
+
+        last_directory = inode;
+
+        return get_directory(inode);
     }
 
     // Function adds new file or directory (specified with bool argument)
-    // into existing directory. It informs inodes allocator and inodes
-    // structures to mark specified fields as used and also asks memory
-    // allocation system for 1 block of memory for created file.
-    void add_new_file_to_directory(Directory& dir, const std::string& file_name, bool is_dir) {
+    // into existing directory. Inode and 1 block of memory for created
+    // file are taken from the allocators beforehand; inodes structures
+    // are informed to mark the inode as used.
+    void add_new_file_to_directory(Directory& dir, std::string_view file_name, bool is_dir, New_File& file) {
 
-        uint16_t file_inode     = inodes_allocator.get_free_index();
-        uint16_t file_mem_block = memory_allocator.get_free_index();
+        if (dir.get_file_inode(file_name))
+            throw std::runtime_error("File already exists");
 
-        if (!file_inode || !file_mem_block)
+        if (!inodes.can_add_pointer_to_inode(dir.inode_num))
+            throw std::runtime_error("Unable to create new file; Directory is full");
+
+        reserve_entry(dir, file_name, 1, "Unable to create new file; Missing free space");
+
+        if (!file.inode || !file.block)
             throw std::runtime_error("Unable to create new file; Missing free space");
 
-        inodes_allocator.mark_as_used(file_inode);
-        memory_allocator.mark_as_used(file_mem_block);
+        index_t file_inode = file.inode;
 
-        inodes.create_new_inode(file_inode, is_dir, file_mem_block);
+        inodes.create_new_inode(file_inode, is_dir, file.block);
+        file.inode = file.block = 0;
         dir.add_new_file(file_name, file_inode);
+        image.log_entry(dir.inode_num, file_name, file_inode);
         inodes.add_pointer_to_inode(dir.inode_num);
+        dentries.invalidate(dir.inode_num, file_name);
+
+        if (is_dir) {
+            image.log_directory_written(file_inode);
+            subtrees.set_parent(file_inode, dir.inode_num);
+            subtrees.set(file_inode, 0, 0, 0);
+        } else
+            subtrees.add_file_parent(file_inode, dir.inode_num);
+
+        subtrees.propagate(dir.inode_num, dir.get_entry_size(file_name), !is_dir, is_dir);
     }
 
-    // Function allocates needed blocks of memory for a
-    // file or directory if it has run out of space.
-    // Function will ask memory allocation system for as many
-    // blocks as possible in order to fulfill the requirements
-    // needed for saving the file into file system.
-    void allocate_needed_memory(uint16_t mem_block, uint16_t dir_content_size, uint16_t dir_actual_size) {
+    // Function makes sure memory blocks of the directory hold its
+    // entries along with a new one of the name, leaving file_blocks
+    // more blocks free. Directories are encoded lazily, but blocks
+    // they need are taken as soon as entries are added, so a change
+    // which does not fit fails itself instead of a later write-back.
+    void reserve_entry(const Directory& dir, std::string_view name, index_t file_blocks, const char* error) {
 
-        while (dir_content_size > dir_actual_size) {
+        const ui block_size = memory->get_memory_block_size();
 
-            uint16_t next_block = memory_allocator.get_free_index();
+        length_t needed   = dir.get_encoded_size() + dir.get_entry_size(name);
+        length_t capacity = get_file_capacity(dir.inode_num);
+        length_t missing  = needed > capacity ? (needed - capacity + block_size - 1) / block_size : 0;
+
+        if (missing + file_blocks > memory_allocator.get_free_amount())
+            throw std::runtime_error(error);
+
+        if (missing)
+            allocate_needed_memory(dir.inode_num, needed, capacity);
+    }
+
+    // Self-explaining.
+    index_t blocks_for(length_t bytes) const {
+
+        const ui block_size = memory->get_memory_block_size();
+
+        return (bytes + block_size - 1) / block_size;
+    }
+
+    // Function takes count free memory blocks, preferably
+    // right after the block last. A single block comes from
+    // the magazine of the thread, more of them in contiguous
+    // ranges. It needs no state lock. Nothing is taken if
+    // there are not enough free blocks for all of them.
+    extent_v take_blocks(index_t last, index_t count) {
+
+        extent_v blocks;
+
+        if (count > memory_allocator.get_free_amount())
+            throw std::runtime_error("Unable to extend directory; Out of memory");
+
+        while (count) {
+
+            Extent range = count == 1 ? Extent{memory_allocator.take_free_index(last + 1), 1}
+                                      : memory_allocator.take_free_range(last + 1, count);
+
+            if (!range.start || !range.length) {
+
+                for (auto const& e : blocks)
+                    memory_allocator.free_range(e);
 
-            if (!next_block)
                 throw std::runtime_error("Unable to extend directory; Out of memory");
+            }
 
-            memory.append_to_block_list(mem_block, next_block);
-            memory_allocator.mark_as_used(next_block);
-            dir_actual_size += Memory_Blocks::get_memory_block_size();
+            blocks.push_back(range);
+            last   = range.start + range.length - 1;
+            count -= range.length;
         }
+
+        return blocks;
+    }
+
+    // Function appends taken blocks to the block list of the inode.
+    void link_blocks(index_t inode, const extent_v& blocks) {
+
+        index_t last = inodes.get_last_block(inode);
+
+        for (auto const& e : blocks)
+            for (index_t next_block = e.start; next_block < e.start + e.length; next_block++) {
+
+                memory->append_to_block_list(last, next_block);
+                inodes.append_block_to_inode(inode, next_block);
+                last = next_block;
+            }
+    }
+
+    // Function allocates needed blocks of memory for a
+    // file or directory if it has run out of space.
+    // Blocks are taken preferably right after the last
+    // block of the file, until the requirements needed
+    // for saving the file into file system are fulfilled.
+    void allocate_needed_memory(index_t inode, length_t dir_content_size, length_t dir_actual_size) {
+        link_blocks(inode, take_blocks(inodes.get_last_block(inode), blocks_for(dir_content_size - dir_actual_size)));
+    }
+
+    // Function allocates blocks of a file growing to end bytes
+    // like allocate_needed_memory, but the state lock is released
+    // while they are taken. The inode lock held by the caller
+    // keeps the block list of the file as it is meanwhile.
+    void extend_file(index_t inode, length_t end, length_t capacity, std::unique_lock<std::mutex>& state) {
+
+        index_t last = inodes.get_last_block(inode);
+
+        state.unlock();
+        extent_v blocks = take_blocks(last, blocks_for(end - capacity));
+        state.lock();
+
+        link_blocks(inode, blocks);
     }
 
     // Function will free memory blocks from a file
@@ -100,15 +498,28 @@ private:
     // It will simply inform memory allocation system
     // to free as many blocks as possible until the file
     // fits into memory blocks list.
-    void deallocate_excessive_memory(uint16_t mem_block, uint16_t dir_content_size, uint16_t dir_actual_size) {
+    void deallocate_excessive_memory(index_t inode, length_t dir_content_size, length_t dir_actual_size) {
 
-        while (dir_content_size < dir_actual_size - Memory_Blocks::get_memory_block_size()) {
+        const ui block_size = memory->get_memory_block_size();
 
-            uint16_t freed_block = memory.erase_from_block_list(mem_block);
-            memory_allocator.free(freed_block);
-            dir_actual_size -= Memory_Blocks::get_memory_block_size();
-        }
+        if (dir_content_size < dir_actual_size - block_size)
+            release_blocks(inode, dir_content_size / block_size + 1);
+    }
+
+    // Function keeps the first keep blocks of the inode. The rest of
+    // its block list is detached at once and freed in bulk, a range
+    // of contiguous blocks at a time, without walking the list.
+    void release_blocks(index_t inode, index_t keep) {
+
+        auto detached = inodes.remove_blocks_from_inode(inode, keep);
+
+        if (detached.empty())
+            return;
 
+        memory->detach_from_block_list(inodes.get_last_block(inode), detached);
+
+        for (auto const& e : detached)
+            memory_allocator.free_range(e);
     }
 
     // Function will add link to directory.
@@ -117,7 +528,7 @@ private:
     // is the directory into which the link will be added.
     // Lastly, the link is the name of the link which
     // will be created.
-    void add_link_to_directory(Directory& dir, uint16_t src, const std::string& link) {
+    void add_link_to_directory(Directory& dir, index_t src, std::string_view link) {
 
         if (!src)
             throw std::runtime_error("File does not exist");
@@ -125,54 +536,133 @@ private:
         if (inodes.is_inode_directory(src))
             throw std::runtime_error("Unable to link directory");
 
+        if (dir.get_file_inode(link))
+            throw std::runtime_error("File already exists");
+
+        if (!inodes.can_add_pointer_to_inode(src) || !inodes.can_add_pointer_to_inode(dir.inode_num))
+            throw std::runtime_error("Unable to create link; Too many links");
+
+        reserve_entry(dir, link, 0, "Unable to create link; Missing free space");
         dir.add_new_file(link, src);
+        image.log_entry(dir.inode_num, link, src);
         inodes.add_pointer_to_inode(dir.inode_num);
         inodes.add_pointer_to_inode(src);
-    }
+        dentries.invalidate(dir.inode_num, link);
 
-    // Self-explaining.
-    void save_directory_to_memory(const Directory& dir) {
+        subtrees.add_file_parent(src, dir.inode_num);
+        subtrees.propagate(dir.inode_num, dir.get_entry_size(link) + get_file_length(src), 1, 0);
+    }
 
-        auto dir_content = dir.get_directory_content();
-        auto mem_block   = dir.mem_block;
-        save_content_to_memory(mem_block, dir_content);
+    // Function marks cached directory as modified.
+    // It will be written back into memory lazily.
+    void mark_directory_dirty(const Directory& dir) {
+        directories.mark_dirty(dir.inode_num);
     }
 
     // Self-explaining.
-    void save_file_to_memory(const File& file) {
+    void write_back_directory(const Directory& dir) {
 
-        auto file_content = file.get_file_content();
-        auto file_mem_b   = file.get_file_mem_block();
-        save_content_to_memory(file_mem_b, file_content);
+        auto dir_content = dir.get_directory_content();
+        save_content_to_memory(dir.inode_num, dir_content);
+        image.log_directory_written(dir.inode_num);
     }
 
     // Function will save the vector named content
     // containing the content of the file or the
-    // directory into the memory list pointed by
-    // mem_block. Mem_block points to the head
-    // of the memory blocks list.
-    // IMPORTANT: at this point there is an assumption
-    // that all needed memory is already allocated at the list
-    // and the content will safely fit into this list.
-    void save_content_to_memory(uint16_t mem_block, const vec_c& content) {
+    // directory into the memory list of the inode.
+    // Memory list is first extended or shrunk, so that
+    // the content will safely fit into this list.
+    void save_content_to_memory(index_t inode, const vec_c& content) {
 
-        uint16_t content_size = content.size();
-        uint16_t actual_size  = memory.get_file_size(mem_block);
+        length_t content_size = content.size();
+        length_t actual_size  = get_file_capacity(inode);
 
         if (content_size > actual_size)
-            allocate_needed_memory(mem_block, content_size, actual_size);
+            allocate_needed_memory(inode, content_size, actual_size);
         else
-            deallocate_excessive_memory(mem_block, content_size, actual_size);
+            deallocate_excessive_memory(inode, content_size, actual_size);
 
-        memory.save_file(mem_block, content);
+        memory->save_file(inodes.get_extents(inode), content);
+        set_file_length(inode, content.size());
+    }
+
+    // Function writes size bytes of data at offset of the content of
+    // the inode. Only blocks covering the written range are touched;
+    // new blocks are allocated only when data goes past the end of the
+    // content, and a gap between the end and offset is filled with zeros.
+    // Writing no data changes nothing, wherever the offset is.
+    // Blocks are reserved and the changes so far logged under the state
+    // lock, which is released while data is copied, so only the lock of
+    // the inode, held by the caller, guards the copy.
+    void write_content_to_memory(index_t inode, length_t offset, const char* data, std::size_t size,
+                                 std::unique_lock<std::mutex>& state) {
+
+        static const char zeros[4096] = {};
+
+        if (!size)
+            return;
+
+        if (offset > std::numeric_limits<length_t>::max() - size)
+            throw std::runtime_error("Offset is too large; Unable to write into file");
+
+        length_t length   = get_file_length(inode);
+        length_t end      = std::max(length, offset + size);
+        length_t capacity = get_file_capacity(inode);
+
+        if (end > capacity)
+            extend_file(inode, end, capacity, state);
+
+        auto const& extents = inodes.get_extents(inode);
+
+        for (length_t pos = length; pos < offset; ) {
+
+            std::size_t chunk = std::min<length_t>(sizeof(zeros), offset - pos);
+
+            memory->write_content(extents, inodes.locate(inode, pos), zeros, chunk);
+            pos += chunk;
+        }
+
+        Extent_Position to = inodes.locate(inode, offset);
+
+        log_changes();
+        state.unlock();
+
+        memory->copy_content(extents, to, data, size);
+
+        state.lock();
+        memory->mark_filled(extents, to, size);
+        set_file_length(inode, end);
+    }
+
+    // Function shrinks content of the inode to length bytes.
+    // Only the block list past the new end and the occupied
+    // amount of the new last block change; content itself
+    // is neither read nor written.
+    void truncate_content_in_memory(index_t inode, length_t length) {
+
+        const ui block_size = memory->get_memory_block_size();
+
+        deallocate_excessive_memory(inode, length, get_file_capacity(inode));
+
+        memory->shrink_block(inodes.get_last_block(inode),
+                             length - (length_t) (inodes.get_blocks_amount(inode) - 1) * block_size);
+        set_file_length(inode, length);
+    }
+
+    // Function appends size bytes of data to the content of the inode.
+    // Data fills the free space of the last block first and the rest
+    // goes into newly allocated blocks, so the existing content
+    // is neither read nor written again.
+    void append_content_to_memory(index_t inode, const char* data, std::size_t size, std::unique_lock<std::mutex>& state) {
+        write_content_to_memory(inode, get_file_length(inode), data, size, state);
     }
 
     // Function checks whether the directory does not
     // have any files/dirs/links inside.
     // Generally speaking it checks if the dir is empty.
-    bool can_erase_directory_from_directory(Directory& dir, const std::string& s) {
+    bool can_erase_directory_from_directory(Directory& dir, std::string_view s) {
 
-        uint16_t inode = dir.get_file_inode(s);
+        index_t inode = dir.get_file_inode(s);
 
         return !inodes.get_inode_pointers(inode);
     }
@@ -183,9 +673,9 @@ private:
     // tasks needed to maintain the unity of the system:
     // freeing inode and memory block, erasing memory list
     // and decreasing number of files inside the directory.
-    void erase_from_directory(Directory& dir, const std::string& s) {
+    void erase_from_directory(Directory& dir, std::string_view s) {
 
-        uint16_t file_node = dir.get_file_inode(s);
+        index_t file_node = dir.get_file_inode(s);
 
         if (!file_node)
             throw std::runtime_error("File not found");
@@ -195,25 +685,38 @@ private:
         else if (!inodes.is_inode_directory(file_node))
             inodes.remove_pointer_from_inode(file_node);
 
+        if (inodes.is_inode_directory(file_node)) {
+            subtrees.propagate(dir.inode_num, -(long) dir.get_entry_size(s), 0, -1);
+            subtrees.forget(file_node);
+            last_path.clear();
+            last_directory = 0;
+        } else {
+            subtrees.propagate(dir.inode_num, -(long) (dir.get_entry_size(s) + get_file_length(file_node)), -1, 0);
+            subtrees.remove_file_parent(file_node, dir.inode_num);
+        }
+
         if (!inodes.get_inode_pointers(file_node)) {
-            uint16_t mem_block = inodes.get_inode_mem_block(file_node);
+            auto const& freed_blocks = get_extents(file_node);
             inodes_allocator.free(file_node);
-            auto freed_blocks = memory.free_memory(mem_block);
-            for (auto block : freed_blocks)
-                memory_allocator.free(block);
+            memory->free_memory(freed_blocks);
+            for (auto const& e : freed_blocks)
+                memory_allocator.free_range(e);
 
+            inodes.unmap_inode(file_node);
+            directories.drop(file_node);
+            image.log_directory_written(file_node);
         }
 
         dir.erase_file(s);
+        image.log_entry(dir.inode_num, s, 0);
         inodes.remove_pointer_from_inode(dir.inode_num);
+        dentries.invalidate(dir.inode_num, s);
     }
 
-    // Function gets File object representing a file
-    // contained by directory dir.
-    File get_file(const Directory& dir, const std::string& file_name) {
+    // Function gives inode of a file contained by directory dir.
+    index_t get_file_inode(const Directory& dir, std::string_view file_name) {
 
-        uint16_t file_inode = dir.get_file_inode(file_name);
-        uint16_t file_mem   = inodes.get_inode_mem_block(file_inode);
+        index_t file_inode = dir.get_file_inode(file_name);
 
         if (!file_inode)
             throw std::runtime_error("File not found; Unable to write into file");
@@ -221,199 +724,477 @@ private:
         if (inodes.is_inode_directory(file_inode))
             throw std::runtime_error("Attempt to open directory as file");
 
-        auto content = memory.full_file_content(file_mem);
-
-        return File(file_mem, content);
+        return file_inode;
     }
 
-    // Self-explaining.
-    ui get_dir_size(uint16_t inode) {
+    // Function gives aggregate of the whole directory subtree.
+    // Subtrees are summed up only the first time they are needed
+    // and maintained incrementally afterwards. Cached directories
+    // are used when present, the others are decoded without
+    // filling the cache with them.
+    const Subtree_Sizes::Subtree& get_subtree(index_t inode) {
 
-        auto mem_b = inodes.get_inode_mem_block(inode);
-        auto conte = memory.full_file_content(mem_b);
+        if (subtrees.is_valid(inode))
+            return subtrees.get(inode);
 
-        Directory dir(inode, mem_b, conte);
-        ui size = dir.get_directory_content().size();
+        const Directory* cached = directories.peek(inode);
+        Directory        loaded = cached ? Directory(inode, 0, format.index_bytes, vec_c()) : load_directory(inode);
+        const Directory& dir    = cached ? *cached : loaded;
 
-        for (unsigned short i : dir.inodes) {
+        length_t bytes = dir.get_encoded_size();
+        ui       files = 0;
+        ui       dirs  = 0;
 
-            if (inodes.is_inode_directory(i))
-                size += get_dir_size(i);
-            else {
-                mem_b = inodes.get_inode_mem_block(i);
-                conte = memory.full_file_content(mem_b);
-                size  += conte.size();
-            }
+        for (index_t i : dir.inodes) {
 
+            if (inodes.is_inode_directory(i)) {
+
+                subtrees.set_parent(i, inode);
+
+                auto const& sub = get_subtree(i);
+
+                bytes += sub.bytes;
+                files += sub.files;
+                dirs  += sub.dirs + 1;
+            } else {
+                bytes += get_file_length(i);
+                files++;
+            }
         }
 
-        return size;
+        subtrees.set(inode, bytes, files, dirs);
+
+        for (index_t i : dir.inodes)
+            if (!inodes.is_inode_directory(i))
+                subtrees.add_file_parent(i, inode);
+
+        return subtrees.get(inode);
     }
 
     // Function gives an information about specified directory.
-    void info_directory(const Directory& dir) {
+    void info_directory(const Directory& dir, std::ostream& out) {
+
+        auto const& subtree = get_subtree(dir.inode_num);
 
-        std::cout << "Dir size: " << dir.get_directory_content().size() << " bytes" << std::endl;
+        out << "Dir size: " << dir.get_encoded_size() << " bytes\n";
+        out << "Subtree size: " << subtree.bytes << " bytes. Files: " << subtree.files
+            << ". Directories: " << subtree.dirs << '\n';
 
         for (ui i = 0; i < dir.inodes.size(); i++) {
 
             if (!i)
-                std::cout << "Inner files and directories info:" << std::endl;
+                out << "Inner files and directories info:\n";
 
             if (inodes.is_inode_directory(dir.inodes[i]))
-                std::cout << dir.names[i] << " ---> " << get_dir_size(dir.inodes[i]) << " bytes" << std::endl;
-            else {
-                auto mem_b = inodes.get_inode_mem_block(dir.inodes[i]);
-                auto conte = memory.full_file_content(mem_b);
-                std::cout << dir.names[i] << " ---> " << conte.size() << " bytes" << std::endl;
-            }
+                out << dir.names[i] << " ---> " << get_subtree(dir.inodes[i]).bytes << " bytes\n";
+            else
+                out << dir.names[i] << " ---> " << get_file_length(dir.inodes[i]) << " bytes\n";
+        }
+    }
+
+    // Writes size bytes of data into fd.
+    static void write_buffer(int fd, const char* data, std::size_t size) {
+
+        while (size) {
+
+            ssize_t written = write(fd, data, size);
+
+            if (written < 0 && errno == EINTR)
+                continue;
+
+            if (written <= 0)
+                throw std::runtime_error("Unable to write file content");
+
+            data += written;
+            size -= written;
         }
     }
 
-    static void print_content_of_directory(const Directory & dir) {
-        dir.print_content();
+    // Function writes length bytes of content of the inode into fd through
+    // the export buffer of the thread, export_buffer_size bytes at a time,
+    // whatever the block size. Outputs of at least direct_threshold bytes
+    // bypass the page cache with O_DIRECT if fd supports it; the unaligned
+    // tail is written without it.
+    void export_content(index_t inode, const extent_v& extents, length_t length, int fd) const {
+
+        static thread_local std::unique_ptr<char, void (*)(void*)> buffer(nullptr, free);
+
+        int  flags  = fcntl(fd, F_GETFL);
+        bool direct = length >= direct_threshold && flags >= 0 && !fcntl(fd, F_SETFL, flags | O_DIRECT);
+
+        if (!buffer)
+            buffer.reset((char*) aligned_alloc(direct_alignment, export_buffer_size));
+
+        if (!buffer)
+            throw std::runtime_error("Unable to allocate export buffer");
+
+        for (length_t pos = 0; pos < length; ) {
+
+            std::size_t chunk = std::min<length_t>(export_buffer_size, length - pos);
+
+            memory->read_content(extents, inodes.locate(inode, pos), buffer.get(), chunk);
+
+            if (direct && chunk % direct_alignment) {
+                fcntl(fd, F_SETFL, flags);
+                direct = false;
+            }
+
+            write_buffer(fd, buffer.get(), chunk);
+            pos += chunk;
+        }
+
+        if (direct)
+            fcntl(fd, F_SETFL, flags);
     }
 
-    static void print_file_content(const File& file) {
-        file.print_content();
+    static void print_content_of_directory(const Directory & dir, std::ostream& out) {
+        dir.print_content(out);
     }
 
-    static void add_to_file(File& f, const std::string& m) {
-        f.add_to_file(m);
+    // Function prints content of the file followed by a new line.
+    // Small files are copied into the output buffer; larger ones
+    // printed to the standard output are written from the image
+    // straight to its descriptor.
+    void print_file_content(const extent_v& extents, length_t length, std::ostream& out) const {
+
+        if (length < stream_threshold || &out != &std::cout)
+            memory->stream_content(extents, out);
+        else {
+            out.flush();
+            memory->stream_content(extents, STDOUT_FILENO);
+        }
+
+        out << '\n';
     }
 
-    static void cut_from_file(File& f, ui to_cut) {
-        f.cut_from_file(to_cut);
+    static void info_file(length_t length, std::ostream& out) {
+        out << "File size: " << length << " bytes\n";
     }
 
-    static void info_file(const File& file) {
-        std::cout << "File size: " << file.content.size() << " bytes" << std::endl;
+    static const ui dentry_cache_capacity    = 4096;
+    static const ui directory_cache_capacity = 256;
+    static const ui stream_threshold         = 1 << 16;    // Bytes of a file printed through the output buffer.
+    static const ui export_buffer_size       = 1 << 20;
+    static const ui direct_threshold         = 1 << 26;    // Bytes of a file exported with O_DIRECT.
+    static const ui journal_limit            = 1 << 26;    // Journal bytes after which the image is saved.
+    static const ui direct_alignment         = 4096;
+
+    File_System(Image& img, Image_Cursor&& c):
+            image(img), format(Format::read(c)), inodes_allocator(c, format),
+            inodes(c, inodes_allocator.get_size(), format), memory_allocator(c, format),
+            memory(Memory_Blocks::load(c, memory_allocator.get_size(), format)),
+            dentries(dentry_cache_capacity), directories(directory_cache_capacity),
+            subtrees(inodes_allocator.get_size()), last_directory(0) {}
+
+    // Function replays the journal of the image, which has to belong
+    // to an image of the same geometry and generation, and gives
+    // cursor at the beginning of the image.
+    static Image_Cursor open_journal(Image& img) {
+
+        Image_Cursor c(img);
+        Format       format = Format::read(c);
+
+        img.open_journal(format.identity(read_uint(c.take(format.index_bytes), format.index_bytes)));
+
+        return Image_Cursor(img);
     }
 
 public:
-    explicit File_System(std::ifstream& f):
-            inodes_allocator(f), inodes(f, inodes_allocator.get_size()),
-            memory_allocator(f), memory(f, memory_allocator.get_size()) {}
+    explicit File_System(Image& img): File_System(img, open_journal(img)) {
+        replay_entries();
+    }
+
 
+    void add_file(const path_v& path, std::string_view file_name) {
 
-    void add_file(const vec_s& path, const std::string& file_name) {
+        New_File                            file(inodes_allocator, memory_allocator);
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::unique_lock<std::mutex>        state(state_lock);
 
-        Directory dir = find_directory(path);
-        add_new_file_to_directory(dir, file_name, false);
-        save_directory_to_memory(dir);
+        Directory& dir = find_directory(path);
+        add_new_file_to_directory(dir, file_name, false, file);
+        mark_directory_dirty(dir);
+        trim_directories();
+        commit(state, tree);
     }
 
-    void write_to_file(const vec_s& path, const std::string& file_name, const std::string& m) {
+    void write_to_file(const path_v& path, std::string_view file_name, std::string_view m) {
+
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::unique_lock<std::mutex>        state(state_lock);
+        std::unique_lock<std::shared_mutex> file;
+
+        index_t inode = get_file_inode(find_directory(path), file_name);
+
+        lock_inode(file, inode, state);
+        append_content_to_memory(inode, m.data(), m.size(), state);
+        trim_directories();
+        commit(file, state, tree);
+    }
+
+    // Appends size bytes read from fd to the file. Blocks for all of them
+    // are reserved before reading, preferably in one contiguous range,
+    // and data is read straight into them. Blocks left unused when
+    // the input ends early are released, and all reserved ones are
+    // if reading fails. The reservation is logged first, so nothing
+    // else copies the blocks, and the input is read holding only
+    // the inode lock.
+    void import_file(const path_v& path, std::string_view file_name, int fd, length_t size) {
+
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::unique_lock<std::mutex>        state(state_lock);
+        std::unique_lock<std::shared_mutex> file;
+
+        index_t inode = get_file_inode(find_directory(path), file_name);
+
+        lock_inode(file, inode, state);
+
+        length_t   length   = get_file_length(inode);
+        length_t   capacity = get_file_capacity(inode);
 
-        Directory dir  = find_directory(path);
-        File      file = get_file(dir, file_name);
+        if (length + size > capacity)
+            extend_file(inode, length + size, capacity, state);
 
-        add_to_file(file, m);
-        save_file_to_memory(file);
+        auto const&     extents = inodes.get_extents(inode);
+        Extent_Position to      = inodes.locate(inode, length);
+
+        log_changes();
+        state.unlock();
+
+        length_t got;
+
+        try {
+            got = memory->read_from(extents, to, fd, size);
+        } catch (const std::runtime_error&) {
+            state.lock();
+            deallocate_excessive_memory(inode, length, get_file_capacity(inode));
+            trim_directories();
+            commit(file, state, tree);
+            throw;
+        }
+
+        state.lock();
+        memory->mark_filled(extents, to, got);
+
+        if (got < size)
+            deallocate_excessive_memory(inode, length + got, get_file_capacity(inode));
+
+        set_file_length(inode, length + got);
+        trim_directories();
+        commit(file, state, tree);
     }
 
-    void cut(const vec_s& path, const std::string& file_name, ui to_cut) {
+    // Writes m at offset of the file, overwriting its content there.
+    // Writes past the end of the file extend it.
+    void write_at(const path_v& path, std::string_view file_name, length_t offset, std::string_view m) {
+
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::unique_lock<std::mutex>        state(state_lock);
+        std::unique_lock<std::shared_mutex> file;
 
-        Directory dir  = find_directory(path);
-        File      file = get_file(dir, file_name);
+        index_t inode = get_file_inode(find_directory(path), file_name);
 
-        cut_from_file(file, to_cut);
-        save_file_to_memory(file);
+        lock_inode(file, inode, state);
+        write_content_to_memory(inode, offset, m.data(), m.size(), state);
+        trim_directories();
+        commit(file, state, tree);
     }
 
+    void cut(const path_v& path, std::string_view file_name, length_t to_cut) {
+
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::unique_lock<std::mutex>        state(state_lock);
+        std::unique_lock<std::shared_mutex> file;
+
+        index_t inode = get_file_inode(find_directory(path), file_name);
+
+        lock_inode(file, inode, state);
 
-    void erase(const vec_s& path, const std::string& file_name) {
+        length_t length = get_file_length(inode);
 
-        Directory dir = find_directory(path);
+        truncate_content_in_memory(inode, to_cut >= length ? 0 : length - to_cut);
+        trim_directories();
+        commit(file, state, tree);
+    }
+
+
+    void erase(const path_v& path, std::string_view file_name) {
+
+        std::unique_lock<std::shared_mutex> tree(tree_lock);
+
+        Directory& dir = find_directory(path);
         erase_from_directory(dir, file_name);
-        save_directory_to_memory(dir);
+        mark_directory_dirty(dir);
+        trim_directories();
+        commit(tree);
     }
 
-    void cat(const vec_s& path, const std::string& name) {
+    void cat(const path_v& path, std::string_view name, std::ostream& out) {
+
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::unique_lock<std::mutex>        state(state_lock);
+        std::shared_lock<std::shared_mutex> file;
 
-        auto dir        = find_directory(path);
-        auto file_inode = dir.get_file_inode(name);
-        auto file_mem_b = inodes.get_inode_mem_block(file_inode);
-        auto content    = memory.full_file_content(file_mem_b);
+        auto file_inode = find_directory(path).get_file_inode(name);
 
         if (!file_inode && name != "/")
             throw std::runtime_error("File does not exist. Unable to perform cat operation");
 
         if (inodes.is_inode_directory(file_inode)) {
-            dir = Directory(file_inode, file_mem_b, content);
-            print_content_of_directory(dir);
-        } else {
-            File file = File(file_mem_b, content);
-            print_file_content(file);
+            print_content_of_directory(get_directory(file_inode), out);
+            trim_directories();
+            return;
         }
 
+        lock_inode(file, file_inode, state);
+
+        auto const& extents = get_extents(file_inode);
+        length_t    length  = get_file_length(file_inode);
+
+        trim_directories();
+        state.unlock();
+
+        print_file_content(extents, length, out);
     }
 
-    void mkdir(const vec_s& path, const std::string& dir_name) {
+    void mkdir(const path_v& path, std::string_view dir_name) {
+
+        New_File                            file(inodes_allocator, memory_allocator);
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::unique_lock<std::mutex>        state(state_lock);
 
-        Directory dir = find_directory(path);
-        add_new_file_to_directory(dir, dir_name, true);
-        save_directory_to_memory(dir);
+        Directory& dir = find_directory(path);
+        add_new_file_to_directory(dir, dir_name, true, file);
+        mark_directory_dirty(dir);
+        trim_directories();
+        commit(state, tree);
     }
 
-    void link(const vec_s& f_path, const std::string& file, const vec_s& l_path, const std::string& link) {
+    void link(const path_v& f_path, std::string_view file, const path_v& l_path, std::string_view link) {
 
-        auto dir     = find_directory(f_path);
-        auto f_inode = dir.get_file_inode(file);
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::unique_lock<std::mutex>        state(state_lock);
+
+        auto f_inode = find_directory(f_path).get_file_inode(file);
+        auto& dir    = find_directory(l_path);
 
-        dir = find_directory(l_path);
         add_link_to_directory(dir, f_inode, link);
-        save_directory_to_memory(dir);
+        mark_directory_dirty(dir);
+        trim_directories();
+        commit(state, tree);
     }
 
-    void info(const vec_s& path, const std::string& name) {
+    void info(const path_v& path, std::string_view name, std::ostream& out) {
+
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::unique_lock<std::mutex>        state(state_lock);
 
-        auto dir   = find_directory(path);
-        auto inode = dir.get_file_inode(name);
-        auto mem_b = inodes.get_inode_mem_block(inode);
-        auto conte = memory.full_file_content(mem_b);
+        auto inode = find_directory(path).get_file_inode(name);
 
         if (!inode && name != "/")
             throw std::runtime_error("File or directory does not exist.");
 
-        if (inodes.is_inode_directory(inode)) {
-            dir = Directory(inode, mem_b, conte);
-            info_directory(dir);
-        }
-        else {
-            File file(mem_b, conte);
-            info_file(file);
-        }
+        if (inodes.is_inode_directory(inode))
+            info_directory(get_directory(inode), out);
+        else
+            info_file(get_file_length(inode), out);
 
+        trim_directories();
     }
 
-    vec_c get_file_content(const vec_s& path, const std::string& name) {
+    // Writes content of the file into fd.
+    void get_file_content(const path_v& path, std::string_view name, int fd) {
+
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::unique_lock<std::mutex>        state(state_lock);
+        std::shared_lock<std::shared_mutex> file;
 
-        auto dir        = find_directory(path);
-        auto file_inode = dir.get_file_inode(name);
-        auto mem_block  = inodes.get_inode_mem_block(file_inode);
-        auto content    = memory.full_file_content(mem_block);
+        auto file_inode = find_directory(path).get_file_inode(name);
 
         if (inodes.is_inode_directory(file_inode))
             throw std::runtime_error("Attempt to get directory");
 
-        return memory.full_file_content(mem_block);
+        lock_inode(file, file_inode, state);
+
+        auto const& extents = get_extents(file_inode);
+        length_t    length  = get_file_length(file_inode);
+
+        trim_directories();
+        state.unlock();
+
+        export_content(file_inode, extents, length, fd);
     }
 
-    void memory_info() const {
-        memory_allocator.info();
+    // Gives at most length bytes of the file content starting at offset.
+    // Reads starting at or past the end of the file give no content.
+    vec_c read(const path_v& path, std::string_view name, length_t offset, length_t length) {
+
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::unique_lock<std::mutex>        state(state_lock);
+        std::shared_lock<std::shared_mutex> file;
+
+        auto file_inode = find_directory(path).get_file_inode(name);
+
+        if (!file_inode && name != "/")
+            throw std::runtime_error("File does not exist. Unable to perform read operation");
+
+        if (inodes.is_inode_directory(file_inode))
+            throw std::runtime_error("Attempt to read directory");
+
+        lock_inode(file, file_inode, state);
+
+        auto const& extents     = get_extents(file_inode);
+        length_t    file_length = get_file_length(file_inode);
+        vec_c       content;
+
+        trim_directories();
+        state.unlock();
+
+        if (offset < file_length) {
+            content.resize(std::min(length, file_length - offset));
+            memory->read_content(extents, inodes.locate(file_inode, offset), content.data(), content.size());
+        }
+
+        return content;
     }
 
-    void inodes_info() const {
-        inodes_allocator.info();
+    // Dirty directories are written back first,
+    // so the blocks they need are accounted for.
+    void memory_info(std::ostream& out) {
+
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::lock_guard<std::mutex>         state(state_lock);
+
+        flush_directories();
+        memory_allocator.info(out);
     }
 
-    void dump_file_system_to_file(std::ofstream& f) {
+    void inodes_info(std::ostream& out) {
 
-        inodes_allocator.dump_allocator_to_file(f);
-        inodes.dump_inodes_to_file(f);
-        memory_allocator.dump_allocator_to_file(f);
-        memory.dump_memory_blocks_to_file(f);
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::lock_guard<std::mutex>         state(state_lock);
+
+        inodes_allocator.info(out);
+    }
+
+    void cache_info(std::ostream& out) {
+
+        std::shared_lock<std::shared_mutex> tree(tree_lock);
+        std::lock_guard<std::mutex>         state(state_lock);
+
+        dentries.info(out);
+        directories.info(out);
+    }
+
+    // Saves records modified since the last save
+    // into the image, which empties the journal.
+    void sync() {
+
+        std::unique_lock<std::shared_mutex> tree(tree_lock);
+
+        flush_directories();
+        write_back();
+        image.save();
     }
 
 };
@@ -433,240 +1214,325 @@ class File_System_Manager {
 
 private:
 
-    static const char* end;
-    static const char* cat;
-    static const char* copy;
-    static const char* erase;
-    static const char* mkdir;
-    static const char* echo;
-    static const char* touch;
-    static const char* link;
-    static const char* cut;
-    static const char* info;
-    static const char* memory;
-    static const char* inodes;
-    static const char* get;
+    static constexpr std::string_view end    = "quit";
+    static constexpr std::string_view cat    = "cat";
+    static constexpr std::string_view copy   = "copy";
+    static constexpr std::string_view erase  = "erase";
+    static constexpr std::string_view mkdir  = "mkdir";
+    static constexpr std::string_view echo   = "echo";
+    static constexpr std::string_view touch  = "touch";
+    static constexpr std::string_view link   = "link";
+    static constexpr std::string_view cut    = "cut";
+    static constexpr std::string_view info   = "info";
+    static constexpr std::string_view memory = "memory";
+    static constexpr std::string_view inodes = "inodes";
+    static constexpr std::string_view cache  = "cache";
+    static constexpr std::string_view get    = "get";
+    static constexpr std::string_view read   = "read";
+    static constexpr std::string_view write  = "write";
+
+    // Handler gets the command line with the file and its directories
+    // already parsed and the stream output of the command goes to.
+    using Handler = void (*)(File_System&, Command_Line&, std::string_view, const path_v&, std::ostream&);
+
+    // Writes n zero bytes. Zeroed regions are skipped over rather
+    // than written, so large images are created as sparse files.
+    static void write_zeros(std::ostream& out, std::size_t n) {
+
+        if (!n)
+            return;
+
+        out.seekp(n - 1, std::ios::cur);
+        out.put(0);
+    }
 
-    static void write_manager(std::ofstream& out, uint16_t size) {
+    // Function gives amount of inodes and memory blocks of an image taking
+    // at most bytes. Every index costs an inode record, a memory block
+    // record and a status bit in both allocators.
+    static index_t indexes_for_size(const Format& format, uint64_t bytes) {
 
-        byte arr[2];
+        uint64_t fixed = Format::superblock_size + 2 * (format.index_bytes + 1);
+        uint64_t bits  = 8 * ((uint64_t) format.inode_record + format.block_record()) + 2;
+        uint64_t size  = bytes > fixed ? (bytes - fixed) * 8 / bits : 0;
 
-        memcpy(arr, &size, sizeof(size));
+        return std::clamp<uint64_t>(size, 2, format.max_indexes());
+    }
 
-        out << arr[0];
-        out << arr[1];
+    // Allocator with every index but the first one free.
+    static void write_manager(std::ofstream& out, const Format& format, index_t size) {
 
-        for (uint16_t i = 0; i < size; i++)
-            out << (i == 0 ? '0' : '1');
+        byte header[4];
 
-    }
+        write_uint(header, size, format.index_bytes);
+        out.write((const char*) header, format.index_bytes);
 
-    static void write_inodes(std::ofstream& out, uint16_t size) {
+        std::vector<byte> status(format.status_bytes(size), format.packed_status ? 0xff : '1');
 
-        for (uint16_t i = 0; i < size; i++) {
-            if (i == 0)
-                out << (byte) 1 << (byte) 0 << (byte) 0 << (byte) 0;
-            else
-                out << (byte) 0 << (byte) 0 << (byte) 0 << (byte) 0;
-        }
-    }
+        if (format.packed_status) {
+            status[0] &= ~1;
+            if (size % 8)
+                status.back() &= (1 << size % 8) - 1;
+        } else
+            status[0] = '0';
 
-    static void write_memory_blocks(std::ostream & out, uint16_t size) {
+        out.write((const char*) status.data(), status.size());
+    }
 
-        const uint16_t block_content = 50;
-        char  empty_block[block_content];
+    // Inodes with the root directory using the first memory block.
+    static void write_inodes(std::ofstream& out, const Format& format, index_t size) {
 
-        for (char & i : empty_block)
-            i = 0;
+        std::vector<char> root(format.inode_record, 0);
 
-        for (uint16_t i = 0; i < size; i++) {
-            out << (byte) 0 << (byte) 0 << (byte) 0;
-            out.write(empty_block, block_content);
-        }
+        root[0] = 1;
 
+        out.write(root.data(), root.size());
+        write_zeros(out, (std::size_t) (size - 1) * format.inode_record);
     }
 
-    static ui get_file_content_size(std::ifstream& input) {
-
-        input.seekg (0, std::ifstream::end);
-        ui size = input.tellg();
-        input.seekg (0, std::ifstream::beg);
+    static void write_memory_blocks(std::ostream & out, const Format& format, index_t size) {
+        write_zeros(out, (std::size_t) size * format.block_record());
+    }
 
-        return size;
+    static void echo_command(File_System& system, Command_Line& line, std::string_view file, const path_v& file_path, std::ostream&) {
+        system.write_to_file(file_path, file, line.rest());
     }
 
-    static std::string convert_to_string(char* buffer, ui length) {
+    static void cat_command(File_System& system, Command_Line&, std::string_view file, const path_v& file_path, std::ostream& out) {
+        system.cat(file_path, file, out);
+    }
 
-        std::string m;
+    static void touch_command(File_System& system, Command_Line&, std::string_view file, const path_v& file_path, std::ostream&) {
+        system.add_file(file_path, file);
+    }
 
-        for (ui i = 0; i < length; i++)
-            m.append(1, buffer[i]);
-            
-        delete [] buffer;
+    static void erase_command(File_System& system, Command_Line&, std::string_view file, const path_v& file_path, std::ostream&) {
+        system.erase(file_path, file);
+    }
 
-        return m;
+    static void mkdir_command(File_System& system, Command_Line&, std::string_view dir, const path_v& dir_path, std::ostream&) {
+        system.mkdir(dir_path, dir);
     }
 
-    static std::string get_file_content(const std::string& name) {
+    static void copy_command(File_System& system, Command_Line& line, std::string_view file, const path_v& file_path, std::ostream&) {
 
-        std::ifstream input(name);
+        int         input = open(std::string(line.next_token()).c_str(), O_RDONLY);
+        struct stat host;
 
-        if (!input)
+        if (input < 0 || fstat(input, &host) < 0) {
+            if (input >= 0)
+                close(input);
             throw std::runtime_error("Unable to open file to copy from");
+        }
 
-        ui length = get_file_content_size(input);
-        char* buffer = new char[length];
-        input.read(buffer, length);
+        posix_fadvise(input, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-        return convert_to_string(buffer, length);
+        try {
+            system.import_file(file_path, file, input, host.st_size);
+        } catch (const std::runtime_error&) {
+            close(input);
+            throw;
+        }
+
+        close(input);
     }
 
-    static void echo_command(File_System& system, const std::string& file, const vec_s& file_path) {
+    static void link_command(File_System& system, Command_Line& line, std::string_view file, const path_v& file_path, std::ostream&) {
 
-        std::string message;
-        std::getline(std::cin, message);
-        message.erase(0, 1);
+        auto l = line.next_path(1);
 
-        system.write_to_file(file_path, file, message);
+        system.link(file_path, file, line.get_path(1), l);
     }
 
-    static void cat_command(File_System& system, const std::string& file, const vec_s& file_path) {
-        system.cat(file_path, file);
-    }
+    static length_t to_length(std::string_view token, const char* error) {
 
-    static void touch_command(File_System& system, const std::string& file, const vec_s& file_path) {
-        system.add_file(file_path, file);
+        length_t value = 0;
+
+        if (std::from_chars(token.data(), token.data() + token.size(), value).ec != std::errc())
+            throw std::runtime_error(error);
+
+        return value;
     }
 
-    static void erase_command(File_System& system, const std::string& file, const vec_s& file_path) {
-        system.erase(file_path, file);
+    static void cut_command(File_System& system, Command_Line& line, std::string_view file, const path_v& file_path, std::ostream&) {
+        system.cut(file_path, file, to_length(line.next_token(), "Incorrect amount of bytes to cut"));
     }
 
-    static void mkdir_command(File_System& system, const std::string& dir, const vec_s& dir_path) {
-        system.mkdir(dir_path, dir);
+    static void read_command(File_System& system, Command_Line& line, std::string_view file, const path_v& file_path, std::ostream& out) {
+
+        auto offset  = to_length(line.next_token(), "Incorrect offset to read from");
+        auto length  = to_length(line.next_token(), "Incorrect amount of bytes to read");
+        auto content = system.read(file_path, file, offset, length);
+
+        out.write(content.data(), content.size()) << '\n';
     }
 
-    static void copy_command(File_System& system, const std::string& file, const vec_s& file_path) {
+    static void write_command(File_System& system, Command_Line& line, std::string_view file, const path_v& file_path, std::ostream&) {
 
-        std::string src_file, content;
-        std::cin >> src_file;
-        content = get_file_content(src_file);
+        auto offset = to_length(line.next_token(), "Incorrect offset to write at");
 
-        system.write_to_file(file_path, file, content);
+        system.write_at(file_path, file, offset, line.rest());
     }
 
-    static void link_command(File_System& system, const std::string& file, const vec_s& file_path) {
+    static void info_command(File_System& system, Command_Line&, std::string_view file, const path_v& file_path, std::ostream& out) {
 
-        std::string l;
-        std::cin >> l;
-        auto link_path = path(l);
+        if (file == memory)
+            system.memory_info(out);
+        else if (file == inodes)
+            system.inodes_info(out);
+        else if (file == cache)
+            system.cache_info(out);
+        else
+            system.info(file_path, file, out);
 
-        system.link(file_path, file, link_path, l);
     }
 
-    static void cut_command(File_System& system, const std::string& file, const vec_s& file_path) {
+    static void get_command(File_System& system, Command_Line& line, std::string_view file, const path_v& file_path, std::ostream&) {
+
+        int output = open(std::string(line.next_token()).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
-        ui to_cut;
-        std::cin >> to_cut;
+        if (output < 0)
+            throw std::runtime_error("File does not exist");
+
+        try {
+            system.get_file_content(file_path, file, output);
+        } catch (const std::runtime_error&) {
+            close(output);
+            throw;
+        }
 
-        system.cut(file_path, file, to_cut);
+        close(output);
     }
 
-    static void info_command(File_System& system, const std::string& file, const vec_s& file_path) {
+    static constexpr uint32_t hash(std::string_view command) {
 
-        if (file == memory)
-            system.memory_info();
-        else if (file == inodes)
-            system.inodes_info();
-        else
-            system.info(file_path, file);
+        uint32_t h = 2166136261u;
 
+        for (char c : command)
+            h = (h ^ (byte) c) * 16777619u;
+
+        return h;
     }
 
-    static void get_command(File_System& system, const std::string& file, const vec_s& file_path) {
+    // Function gives handler of the command or nullptr if there is none.
+    // Cases are hashes of command names computed at compile time,
+    // so the compiler rejects any collision between them and finding
+    // a handler costs one hash and one comparison.
+    static Handler find_handler(std::string_view command) {
+
+        std::string_view name;
+        Handler          handler;
+
+        switch (hash(command)) {
+            case hash(cat):   name = cat;   handler = cat_command;   break;
+            case hash(copy):  name = copy;  handler = copy_command;  break;
+            case hash(erase): name = erase; handler = erase_command; break;
+            case hash(mkdir): name = mkdir; handler = mkdir_command; break;
+            case hash(echo):  name = echo;  handler = echo_command;  break;
+            case hash(touch): name = touch; handler = touch_command; break;
+            case hash(link):  name = link;  handler = link_command;  break;
+            case hash(cut):   name = cut;   handler = cut_command;   break;
+            case hash(info):  name = info;  handler = info_command;  break;
+            case hash(get):   name = get;   handler = get_command;   break;
+            case hash(read):  name = read;  handler = read_command;  break;
+            case hash(write): name = write; handler = write_command; break;
+            default:          return nullptr;
+        }
 
-        std::string output_path;
-        std::cin >> output_path;
+        return command == name ? handler : nullptr;
+    }
 
-        std::ofstream output(output_path);
+    // Function executes commands read from in until quit
+    // or the end of input. It gives amount of executed commands.
+    static std::size_t execute_commands(File_System& system, std::istream& in) {
 
-        if (!output)
-            throw std::runtime_error("File does not exist");
+        Command_Line line;
+        std::size_t  executed = 0;
 
-        auto content = system.get_file_content(file_path, file);
+        while (line.read(in) && execute_command(system, line, std::cout, std::cerr))
+            executed++;
 
-        write_string(output, content, content.size());
-        output.close();
+        return executed;
     }
 
 public:
-    static void make_empty_file_system(std::ofstream& out, uint16_t bytes) {
+    // Function executes the command read into line. Its output goes
+    // to out and error messages to err. It gives false for the command
+    // ending the session, which is not executed.
+    static bool execute_command(File_System& system, Command_Line& line, std::ostream& out, std::ostream& err) {
+
+        auto command = line.next_token();
 
-        uint16_t size = bytes / 4;
+        if (command == end)
+            return false;
 
-        write_manager(out, size);       // Inodes manager.
-        write_inodes(out, size);        // Inodes.
-        write_manager(out, size);       // Memory manager.
-        write_memory_blocks(out, size); // Memory blocks.
+        auto    file    = line.next_path(0);
+        Handler handler = find_handler(command);
+
+        try {
+
+            if (handler)
+                handler(system, line, file, line.get_path(0), out);
+            else
+                out << "Unrecognised command\n";
+
+        } catch (const std::runtime_error& e) {
+            err << e.what() << std::endl;
+        }
+
+        return true;
+    }
+
+    // New file systems use the wide format. Journal left by an
+    // earlier image of the same name is emptied; the new image
+    // gets a generation of its own, so it would be refused anyway.
+    // Unsupported block sizes are refused before the file is touched.
+    static void make_empty_file_system(const std::string& file_name, uint64_t bytes, ui block_size) {
+
+        if (!Format::is_block_size_supported(block_size))
+            throw std::runtime_error("Unsupported file system block size");
+
+        std::ofstream out(file_name);
+        Format        format = Format::wide(block_size);
+        index_t       size   = indexes_for_size(format, bytes);
+
+        format.generation = std::random_device()();
+
+        format.write_superblock(out);            // Superblock.
+        write_manager(out, format, size);        // Inodes manager.
+        write_inodes(out, format, size);         // Inodes.
+        write_manager(out, format, size);        // Memory manager.
+        write_memory_blocks(out, format, size);  // Memory blocks.
+
+        if (!out.flush())
+            throw std::runtime_error("Unable to create file system image");
+
+        if (truncate(Image::journal_name(file_name).c_str(), 0) < 0 && errno != ENOENT)
+            throw std::runtime_error("Unable to clear journal");
     }
 
     static void manage_file_system(File_System& system) {
+        execute_commands(system, std::cin);
+    }
 
-        std::string command, file, message;
-        std::cin >> command;
-
-        while (command != end) {
-
-            std::cin >> file;
-            vec_s file_path = path(file);
-
-            try {
-
-                if (command == echo)
-                    echo_command(system, file, file_path);
-                else if (command == touch)
-                    touch_command(system, file, file_path);
-                else if (command == cat)
-                    cat_command(system, file, file_path);
-                else if (command == erase)
-                    erase_command(system, file, file_path);
-                else if (command == mkdir)
-                    mkdir_command(system, file, file_path);
-                else if (command == copy)
-                    copy_command(system, file, file_path);
-                else if (command == link)
-                    link_command(system, file, file_path);
-                else if (command == cut)
-                    cut_command(system, file, file_path);
-                else if (command == info)
-                    info_command(system, file, file_path);
-                else if (command == get)
-                    get_command(system, file, file_path);
-                else
-                    std::cout << "Unrecognised command\n";
-
-            } catch (const std::runtime_error& e) {
-                std::cerr << e.what() << std::endl;
-            }
-            std::cin >> command;
-        }
+    // Batch mode. Commands are read from in without any prompts
+    // and the whole run, including saving the image, is timed.
+    // Statistics go to the error stream, so they do not mix
+    // with the output of the commands.
+    static void run_script(File_System& system, std::istream& in) {
+
+        auto start    = std::chrono::steady_clock::now();
+        auto executed = execute_commands(system, in);
+
+        system.sync();
 
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout.flush();
+        std::cerr << "Executed " << executed << " commands in " << std::fixed << std::setprecision(3)
+                  << elapsed.count() << " s (" << std::setprecision(0)
+                  << (elapsed.count() > 0 ? executed / elapsed.count() : 0) << " ops/sec)" << std::endl;
     }
 
 };
 
-const char* File_System_Manager::cat    = "cat";
-const char* File_System_Manager::end    = "quit";
-const char* File_System_Manager::copy   = "copy";
-const char* File_System_Manager::erase  = "erase";
-const char* File_System_Manager::mkdir  = "mkdir";
-const char* File_System_Manager::echo   = "echo";
-const char* File_System_Manager::touch  = "touch";
-const char* File_System_Manager::link   = "link";
-const char* File_System_Manager::cut    = "cut";
-const char* File_System_Manager::info   = "info";
-const char* File_System_Manager::memory = "memory";
-const char* File_System_Manager::inodes = "inodes";
-const char* File_System_Manager::get    = "get";
-
 #endif //_FILE_SYSTEM_FILE_SYSTEM_H
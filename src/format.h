@@ -0,0 +1,140 @@
+#ifndef _FILE_SYSTEM_FORMAT_H
+#define _FILE_SYSTEM_FORMAT_H
+
+#include <cstring>
+
+#include "image.h"
+#include "utility.h"
+
+/**
+ * On-disk format of the file system image.
+ *
+ * Legacy images start directly with the inode allocator and
+ * use 16-bit inode and block numbers, 8-bit link counters and
+ * one status character per allocated index, which caps them
+ * at 65535 blocks and 255 links.
+ *
+ * Wide images start with a superblock holding magic, version
+ * and the block content size, which follows from the block size
+ * chosen at creation (64, 512 or 4096 bytes per block record,
+ * header included), and a generation number picked at random
+ * when the image is created. The same sequence of structures
+ * follows, but with 32-bit inode and block numbers, 32-bit
+ * link counters, 64-bit content lengths kept in inode records
+ * and allocator status packed into bits.
+ *
+ * Format describes widths and offsets of all fields, so
+ * Allocator, Inodes, Memory_Blocks and Directory can work
+ * with both of them.
+ */
+struct Format {
+
+    static const ui legacy_version = 1;
+    static const ui wide_version   = 2;
+
+    // Superblock: magic, version, block content size, generation.
+    static const ui superblock_size = 16;
+
+    static const ui default_block_size = 64;
+
+    ui   version;
+    ui   generation;        // Chosen at creation, so a journal can tell images apart.
+    ui   block_content;     // Payload bytes of a memory block.
+    ui   index_bytes;       // Width of inode and block numbers.
+    bool packed_status;     // Allocator status kept in bits instead of characters.
+
+    // Layout of an inode record.
+    ui   links_offset;
+    ui   links_bytes;
+    ui   block_offset;
+    bool stored_length;     // Record keeps 64-bit content length.
+    ui   length_offset;
+    ui   inode_record;
+
+    // Size of a memory block record header; payload follows it.
+    // Fields of the header are described by Block_Geometry.
+    ui   content_offset;
+
+    static const char* magic() {
+        return "RPFS";
+    }
+
+    static Format legacy() {
+        return Format{legacy_version, 0, 50, 2, false, 1, 1, 2, false, 0, 4, 3};
+    }
+
+    static Format wide(ui block_size = default_block_size) {
+
+        Format format{wide_version, 0, 0, 4, true, 4, 4, 8, true, 16, 24, 8};
+
+        format.block_content = block_size - format.content_offset;
+
+        return format;
+    }
+
+    // Block sizes new images may be created with.
+    static bool is_block_size_supported(ui block_size) {
+        return block_size == 64 || block_size == 512 || block_size == 4096;
+    }
+
+    ui block_record() const {
+        return content_offset + block_content;
+    }
+
+    // Bytes of allocator status kept for size indexes.
+    std::size_t status_bytes(std::size_t size) const {
+        return packed_status ? (size + 7) / 8 : size;
+    }
+
+    // Largest link counter which fits into inode record.
+    uint64_t max_links() const {
+        return links_bytes >= 8 ? UINT64_MAX : ((uint64_t) 1 << 8 * links_bytes) - 1;
+    }
+
+    // Largest amount of indexes addressable by allocators.
+    uint64_t max_indexes() const {
+        return ((uint64_t) 1 << 8 * index_bytes) - 1;
+    }
+
+    // Identity of the image with size indexes, which its journal has to match.
+    Journal_Identity identity(index_t size) const {
+        return Journal_Identity{version, block_record(), size, generation};
+    }
+
+    // Function recognises format of the image and consumes its
+    // superblock. Images without magic are legacy ones.
+    static Format read(Image_Cursor& c) {
+
+        const byte* header = c.peek(superblock_size);
+
+        if (!header || memcmp(header, magic(), 4))
+            return legacy();
+
+        header = c.take(superblock_size);
+
+        if (read_uint(header + 4, 4) != wide_version)
+            throw std::runtime_error("Unsupported file system image version");
+
+        Format format = wide();
+
+        format.block_content = read_uint(header + 8, 4);
+        format.generation    = read_uint(header + 12, 4);
+
+        return format;
+    }
+
+    void write_superblock(std::ostream& out) const {
+
+        byte header[superblock_size] = {};
+
+        memcpy(header, magic(), 4);
+        write_uint(header + 4, version, 4);
+        write_uint(header + 8, block_content, 4);
+        write_uint(header + 12, generation, 4);
+
+        out.write((const char*) header, superblock_size);
+    }
+
+};
+
+#endif //_FILE_SYSTEM_FORMAT_H
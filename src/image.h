@@ -0,0 +1,275 @@
+#ifndef _FILE_SYSTEM_IMAGE_H
+#define _FILE_SYSTEM_IMAGE_H
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+
+#include "journal.h"
+#include "utility.h"
+
+/**
+ * Class owning the memory mapping of the file system image.
+ *
+ * The whole file storing the file system is mapped into
+ * the address space, so Allocator, Inodes and Memory_Blocks
+ * work directly on its bytes instead of parsing private
+ * copies of them. The mapping is private: changes stay in
+ * memory until the structures report their modified records
+ * and save writes exactly these ranges back at their offsets.
+ *
+ * Ranges reported since the previous log are also written into
+ * the journal beside the image as one transaction, so changes
+ * survive a crash long before the image is saved. The journal is
+ * replayed onto the mapping before the image is read; directory
+ * entry changes found in it are kept for the file system to apply.
+ * It is emptied whenever the image is saved.
+ *
+ * The file is locked while it is open, so no other process loads
+ * the image and saves over its changes.
+ */
+class Image {
+
+private:
+
+    struct Range {
+        std::size_t offset;
+        std::size_t length;
+    };
+
+    int                      fd;
+    byte*                    data;
+    std::size_t              length;
+    std::vector<Range>       pending;     // Modified ranges waiting for save.
+    std::size_t              logged;      // Pending ranges already in the journal.
+    bool                     lazy;        // Commits do not wait for the journal sync.
+    std::unique_ptr<Journal> journal;     // Opened once the image is locked.
+    entry_change_m           replayed;    // Entry changes found in the journal at load.
+
+    void write_range(std::size_t offset, std::size_t n) {
+
+        while (n) {
+
+            ssize_t written = pwrite(fd, data + offset, n, offset);
+
+            if (written < 0 && errno == EINTR)
+                continue;
+
+            if (written <= 0)
+                throw std::runtime_error("Unable to save file system image");
+
+            offset += written;
+            n      -= written;
+        }
+    }
+
+public:
+    // Self-explaining.
+    static std::string journal_name(const std::string& file_name) {
+        return file_name + ".journal";
+    }
+
+    explicit Image(const std::string& file_name, bool lazy_commit = false):
+            fd(-1), data(nullptr), length(0), logged(0), lazy(lazy_commit) {
+
+        struct stat st;
+
+        fd = open(file_name.c_str(), O_RDWR);
+
+        if (fd < 0)
+            throw std::runtime_error("Unable to open file system image");
+
+        if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+            close(fd);
+            throw std::runtime_error("File system image is used by another process");
+        }
+
+        if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+            close(fd);
+            throw std::runtime_error("Unable to read file system image");
+        }
+
+        length = st.st_size;
+        void* m = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+        if (m == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Unable to map file system image");
+        }
+
+        data = (byte*) m;
+
+        try {
+            journal = std::make_unique<Journal>(journal_name(file_name));
+        } catch (const std::runtime_error&) {
+            munmap(data, length);
+            close(fd);
+            throw;
+        }
+    }
+
+    Image(const Image&)            = delete;
+    Image& operator=(const Image&) = delete;
+
+    // Transactions still queued are written into the journal
+    // before the image is unlocked.
+    ~Image() {
+        journal.reset();
+        munmap(data, length);
+        close(fd);
+    }
+
+    // Applies ranges left in the journal by a run which did not save
+    // the image. They are in the journal already and are saved
+    // along with the next save. It has to be called before the
+    // image is read; the journal must belong to the image of identity.
+    void open_journal(const Journal_Identity& identity) {
+
+        journal->replay(identity, [this](std::size_t offset, const byte* p, ui n) {
+
+            if (offset > length || n > length - offset)
+                throw std::runtime_error("Corrupted journal; Record outside of the image");
+
+            memcpy(data + offset, p, n);
+            mark_dirty(data + offset, n);
+        }, replayed);
+
+        logged = pending.size();
+    }
+
+    byte* begin() const {
+        return data;
+    }
+
+    std::size_t size() const {
+        return length;
+    }
+
+    // Registers range of the mapping which has to be written on save.
+    void mark_dirty(const byte* p, std::size_t n) {
+        pending.push_back({(std::size_t) (p - data), n});
+    }
+
+    // Gives entry changes of directories found in the journal at load.
+    entry_change_m take_replayed_entries() {
+        return std::move(replayed);
+    }
+
+    // Adds change of a directory entry to the next journal transaction.
+    void log_entry(index_t dir, std::string_view name, index_t inode) {
+        journal->record_entry(dir, name, inode);
+    }
+
+    // Self-explaining.
+    void log_directory_written(index_t dir) {
+        journal->record_directory(dir);
+    }
+
+    // Records ranges registered since the previous log as one journal
+    // transaction, which is written along with others queued meanwhile.
+    // It gives number of the transaction to commit.
+    uint64_t log() {
+
+        for (; logged < pending.size(); logged++)
+            journal->record(pending[logged].offset, data + pending[logged].offset, pending[logged].length);
+
+        return journal->end_transaction();
+    }
+
+    // Returns once the logged transaction is synced into the journal.
+    // Lazy commits return at once; they only throw if some earlier
+    // transaction could not be written.
+    void commit(uint64_t transaction) {
+
+        if (lazy)
+            journal->check();
+        else
+            journal->wait(transaction);
+    }
+
+    // Self-explaining.
+    std::size_t journal_size() {
+        return journal->size();
+    }
+
+    // Writes all registered ranges back into the file.
+    // Ranges not logged yet are logged and the journal is
+    // synced first, so a save torn by a crash is repaired
+    // by replaying it. Adjacent and overlapping ranges are
+    // merged, so neighbouring records are saved with one write.
+    // Once they are synced, the journal is no longer needed.
+    void save() {
+
+        log();
+        journal->flush();
+
+        std::sort(pending.begin(), pending.end(), [](const Range& a, const Range& b) {
+            return a.offset < b.offset;
+        });
+
+        ui idx = 0;
+
+        while (idx < pending.size()) {
+
+            std::size_t start = pending[idx].offset;
+            std::size_t end   = start + pending[idx].length;
+
+            for (idx++; idx < pending.size() && pending[idx].offset <= end; idx++)
+                end = std::max(end, pending[idx].offset + pending[idx].length);
+
+            write_range(start, end - start);
+        }
+
+        if (!pending.empty() && fdatasync(fd) < 0)
+            throw std::runtime_error("Unable to save file system image");
+
+        pending.clear();
+        logged = 0;
+        journal->clear();
+    }
+
+};
+
+/**
+ * Sequential reader over the image.
+ *
+ * Hands out consecutive regions of the mapped image,
+ * the same way the stream used to be consumed while
+ * parsing, so every structure can find its own bytes.
+ */
+class Image_Cursor {
+
+private:
+
+    const Image& image;
+    std::size_t  pos;
+
+public:
+    explicit Image_Cursor(const Image& img): image(img), pos(0) {}
+
+    byte* take(std::size_t n) {
+
+        if (pos + n > image.size())
+            throw std::runtime_error("Corrupted file system image; Unexpected end of file");
+
+        byte* region = image.begin() + pos;
+        pos += n;
+
+        return region;
+    }
+
+    // Gives next n bytes without consuming them or nullptr
+    // if the image ends before.
+    const byte* peek(std::size_t n) const {
+        return pos + n > image.size() ? nullptr : image.begin() + pos;
+    }
+
+};
+
+#endif //_FILE_SYSTEM_IMAGE_H
@@ -1,6 +1,9 @@
 #ifndef _FILE_SYSTEM_INODES_H
 #define _FILE_SYSTEM_INODES_H
 
+#include "dirty_records.h"
+#include "format.h"
+#include "image.h"
 #include "utility.h"
 
 /**
@@ -10,82 +13,225 @@
  * inodes and erasing these, which files are being
  * deleted. It also gives necessary info which
  * is connected with the inode itself.
+ *
+ * Besides the mapped records, every inode which has been
+ * used records the extents of its memory blocks, i.e. the
+ * runs of contiguous blocks its content lives in, so the
+ * block list does not have to be walked link by link.
+ * Next to them it keeps the length of the content, the
+ * amount of blocks and the last block, so size queries
+ * and appends do not have to visit the blocks at all.
+ * Block counts up to the end of every extent index the
+ * blocks, so any offset of the content is located with
+ * a binary search instead of walking the block list.
+ * Records of wide images store the content length as well.
  */
 class Inodes {
 
 private:
 
-    struct Inode;
+    static const ui is_dir_offset = 0;
 
-    using inode_v = std::vector<Inode>;
+    // In-memory part of the inode, known once the inode has been used.
+    struct Inode_Map {
 
-    inode_v nodes;
+        bool     mapped;
+        extent_v extents;
+        vec_i    ends;          // Blocks in the extents up to the end of each of them.
+        length_t length;        // Bytes of content.
+        index_t  blocks;        // Amount of memory blocks.
+        index_t  last_block;
+    };
 
-    struct Inode {
+    using map_t = Paged_Table<Inode_Map>;
 
-        byte     is_dir;
-        byte     number;
-        uint16_t memory_block;
+    const Format  format;
+    byte*         nodes;
+    Dirty_Records dirty;
+    map_t         maps;     // Allocated only for pages of used inodes.
 
-        explicit Inode(std::ifstream& f) {
+    byte* inode(index_t n) const {
+        return nodes + (std::size_t) n * format.inode_record;
+    }
 
-            is_dir       = read_byte(f);
-            number       = read_byte(f);
-            memory_block = read_uint16_t(f);
-        }
+    uint64_t get_links(index_t n) const {
+        return read_uint(inode(n) + format.links_offset, format.links_bytes);
+    }
 
-        void dump_inode(std::ofstream& f) const {
+    void set_links(index_t n, uint64_t links) {
+        write_uint(inode(n) + format.links_offset, links, format.links_bytes);
+        dirty.mark(n);
+    }
 
-            write_byte(f, is_dir);
-            write_byte(f, number);
-            write_uint16_t(f, memory_block);
-        }
+public:
+    explicit Inodes(Image_Cursor& c, index_t size, const Format& f):
+            format(f), nodes(c.take((std::size_t) size * format.inode_record)), dirty(size),
+            maps(size, Inode_Map{false, {}, {}, 0, 0, 0}) {}
 
-    };
+    index_t get_memory_block(index_t inode_number) {
+        return read_uint(inode(inode_number) + format.block_offset, format.index_bytes);
+    }
 
-public:
-    explicit Inodes(std::ifstream& f, uint16_t size): nodes() {
+    void create_new_inode(index_t inode_number, byte is_dir, index_t mem_block) {
+
+        memset(inode(inode_number), 0, format.inode_record);
+        inode(inode_number)[is_dir_offset] = is_dir;
+        write_uint(inode(inode_number) + format.block_offset, mem_block, format.index_bytes);
+        set_links(inode_number, is_dir ? 0 : 1);
+        map_inode(inode_number, extent_v(1, {mem_block, 1}), 0);
+    }
+
+    bool is_inode_mapped(index_t n) const {
+        return maps.get(n).mapped;
+    }
 
-        for (uint16_t i = 0; i < size; i++)
-            nodes.push_back(Inode(f));
+    bool is_length_stored() const {
+        return format.stored_length;
+    }
 
+    // Gives content length kept in the record of wide images.
+    length_t get_stored_length(index_t n) const {
+        return read_uint(inode(n) + format.length_offset, 8);
     }
 
-    uint16_t get_memory_block(uint16_t inode_number) {
-        return nodes[inode_number].memory_block;
+    // Fills in-memory part of the inode.
+    void map_inode(index_t n, extent_v extents, length_t length) {
+
+        auto& m = maps.edit(n);
+
+        m.mapped     = true;
+        m.extents    = std::move(extents);
+        m.length     = length;
+        m.blocks     = 0;
+
+        m.ends.clear();
+
+        for (auto const& e : m.extents)
+            m.ends.push_back(m.blocks += e.length);
+
+        m.last_block = m.extents.back().start + m.extents.back().length - 1;
     }
 
-    void dump_inodes_to_file(std::ofstream& f) {
+    void unmap_inode(index_t n) {
+        maps.edit(n) = Inode_Map{false, {}, {}, 0, 0, 0};
+    }
 
-        for (auto& inode : nodes)
-            inode.dump_inode(f);
+    const extent_v& get_extents(index_t n) const {
+        return maps.get(n).extents;
     }
 
-    void create_new_inode(uint16_t inode_number, byte is_dir, uint16_t mem_block) {
+    // Gives position of the offset of the content within the extents.
+    // Offsets past the last block are given in the last extent.
+    Extent_Position locate(index_t n, length_t offset) const {
+
+        auto const& m     = maps.get(n);
+        index_t     block = std::min<length_t>(offset / format.block_content, m.blocks - 1);
+        std::size_t i     = std::upper_bound(m.ends.begin(), m.ends.end(), block) - m.ends.begin();
 
-        nodes[inode_number].is_dir       = is_dir;
-        nodes[inode_number].number       = is_dir ? 0 : 1;
-        nodes[inode_number].memory_block = mem_block;
+        return {i, offset - (length_t) (m.ends[i] - m.extents[i].length) * format.block_content};
     }
 
-    uint16_t get_inode_mem_block(uint16_t n) const {
-        return nodes[n].memory_block;
+    length_t get_length(index_t n) const {
+        return maps.get(n).length;
     }
 
-    byte get_inode_pointers(uint16_t n) const {
-        return nodes[n].number;
+    void set_length(index_t n, length_t length) {
+
+        maps.edit(n).length = length;
+
+        if (format.stored_length && get_stored_length(n) != length) {
+            write_uint(inode(n) + format.length_offset, length, 8);
+            dirty.mark(n);
+        }
     }
 
-    bool is_inode_directory(uint16_t n) const {
-        return nodes[n].is_dir;
+    index_t get_blocks_amount(index_t n) const {
+        return maps.get(n).blocks;
     }
 
-    void add_pointer_to_inode(uint16_t n) {
-        nodes[n].number++;
+    index_t get_last_block(index_t n) const {
+        return maps.get(n).last_block;
     }
 
-    void remove_pointer_from_inode(uint16_t n) {
-        nodes[n].number--;
+    // Adds block at the end of the inode extents.
+    // Block following the last extent just extends it.
+    void append_block_to_inode(index_t n, index_t block) {
+
+        auto& m = maps.edit(n);
+
+        if (!m.extents.empty() && m.extents.back().start + m.extents.back().length == block) {
+            m.extents.back().length++;
+            m.ends.back()++;
+        } else {
+            m.extents.push_back({block, 1});
+            m.ends.push_back(m.blocks + 1);
+        }
+
+        m.blocks++;
+        m.last_block = block;
+    }
+
+    // Removes all blocks following the first keep ones from the
+    // inode extents and gives extents of the removed blocks.
+    extent_v remove_blocks_from_inode(index_t n, index_t keep) {
+
+        auto&    m = maps.edit(n);
+        extent_v removed;
+
+        if (keep >= m.blocks)
+            return removed;
+
+        std::size_t i    = std::upper_bound(m.ends.begin(), m.ends.end(), keep - 1) - m.ends.begin();
+        index_t     kept = keep - (m.ends[i] - m.extents[i].length);
+
+        if (kept < m.extents[i].length)
+            removed.push_back({m.extents[i].start + kept, m.extents[i].length - kept});
+
+        removed.insert(removed.end(), m.extents.begin() + i + 1, m.extents.end());
+
+        m.extents.resize(i + 1);
+        m.ends.resize(i + 1);
+        m.extents[i].length = kept;
+        m.ends[i]           = keep;
+        m.blocks            = keep;
+        m.last_block        = m.extents[i].start + kept - 1;
+
+        return removed;
+    }
+
+    index_t get_inode_mem_block(index_t n) const {
+        return read_uint(inode(n) + format.block_offset, format.index_bytes);
+    }
+
+    uint64_t get_inode_pointers(index_t n) const {
+        return get_links(n);
+    }
+
+    bool is_inode_directory(index_t n) const {
+        return inode(n)[is_dir_offset];
+    }
+
+    // Link counters of legacy images are single bytes,
+    // so they must not silently wrap around.
+    bool can_add_pointer_to_inode(index_t n) const {
+        return get_links(n) < format.max_links();
+    }
+
+    void add_pointer_to_inode(index_t n) {
+        set_links(n, get_links(n) + 1);
+    }
+
+    void remove_pointer_from_inode(index_t n) {
+        set_links(n, get_links(n) - 1);
+    }
+
+    // Reports modified inode records to the image.
+    void write_back(Image& image) {
+
+        for (auto idx : dirty.get_indexes())
+            image.mark_dirty(inode(idx), format.inode_record);
+
+        dirty.clear();
     }
 
 };
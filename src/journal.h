@@ -0,0 +1,485 @@
+#ifndef _FILE_SYSTEM_JOURNAL_H
+#define _FILE_SYSTEM_JOURNAL_H
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "utility.h"
+
+// Change of a directory entry; inode 0 marks an erased entry.
+struct Entry_Change {
+    std::string name;
+    index_t     inode;
+};
+
+using entry_change_m = std::map<index_t, std::vector<Entry_Change>>;
+
+// Image a journal belongs to: its format version, size of block
+// records, amount of indexes and generation number.
+struct Journal_Identity {
+    ui      version;
+    ui      block_record;
+    index_t indexes;
+    ui      generation;
+};
+
+/**
+ * Write-ahead journal kept in a file beside the image.
+ *
+ * Every operation changing the file system is recorded as one
+ * transaction holding new bytes of all image records it modified,
+ * each with its offset. Directories are cached and written back
+ * lazily, so changes of their entries are recorded as entries
+ * instead; once a directory is written back into the image, a
+ * record saying so ends the need to replay its earlier entries.
+ * Loading replays whole transactions; a torn one at the end is
+ * ignored.
+ *
+ * Transactions are committed in groups by a writer thread, with
+ * one write and one fdatasync per group. Operations wait until the
+ * group holding their transaction is synced; while one group is being
+ * written, transactions of other operations gather into the next one,
+ * so operations committing at the same time share one sync. Without
+ * anyone waiting, a group is written once batch_transactions of them
+ * are queued or batch_window after the first one was queued, so
+ * operations which do not wait lose at most the last batch_window of
+ * them in a crash. Once the image itself is saved, the journal is
+ * emptied.
+ *
+ * The journal starts with the identity of its image: magic (4 bytes),
+ * format version, block record size, amount of indexes and generation
+ * (4 bytes each). A journal of any other image is refused, so offsets
+ * logged for one image are never written into another one.
+ *
+ * Transaction: magic (4 bytes), payload length (8 bytes), payload
+ * checksum (8 bytes), payload. Payload is a sequence of records,
+ * each starting with its kind (1 byte):
+ *  - range:     image offset (8 bytes), length (4 bytes), the bytes;
+ *  - entry:     directory inode (4 bytes), file inode (4 bytes, 0 for
+ *               an erased entry), name length (4 bytes), the name;
+ *  - directory: directory inode (4 bytes) written back or erased.
+ */
+class Journal {
+
+private:
+
+    enum Kind : byte { range, entry, directory };
+
+    static const uint32_t magic              = 0x4c4e524a;  // "JRNL"
+    static const uint32_t identity_magic     = 0x5244484a;  // "JHDR"
+    static const ui       identity_size      = 4 + 4 * 4;
+    static const ui       header_size        = 4 + 8 + 8;
+    static const ui       batch_transactions = 1024;
+
+    static constexpr std::chrono::milliseconds batch_window{5};
+
+    using clock_t = std::chrono::steady_clock;
+
+    int                     fd;
+    std::string             transaction;    // Records of the operation being logged.
+    std::mutex              lock;           // Guards all members below.
+    std::condition_variable queued;         // Wakes the writer.
+    std::condition_variable written;        // Wakes these waiting for the writer.
+    std::string             batch;          // Transactions waiting for the next group commit.
+    ui                      batched;        // Transactions in the batch.
+    clock_t::time_point     first;          // When the first of them was queued.
+    bool                    writing;        // Some group is being written right now.
+    bool                    failed;         // Some group could not be written.
+    bool                    stopping;
+    ui                      flushing;       // Threads waiting for their transactions to be written.
+    uint64_t                ended;          // Transactions queued so far.
+    uint64_t                synced;         // Transactions written and synced so far.
+    std::size_t             length;         // Bytes in the journal file.
+    std::thread             writer;
+
+    static uint64_t checksum(const byte* p, std::size_t n) {
+
+        uint64_t h = 14695981039346656037ULL;
+
+        for (std::size_t i = 0; i < n; i++)
+            h = (h ^ p[i]) * 1099511628211ULL;
+
+        return h;
+    }
+
+    void write_all(const std::string& data) {
+
+        std::size_t done = 0;
+
+        while (done < data.size()) {
+
+            ssize_t n = write(fd, data.data() + done, data.size() - done);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n <= 0)
+                throw std::runtime_error("Unable to write journal");
+
+            done += n;
+        }
+
+        if (fdatasync(fd) < 0)
+            throw std::runtime_error("Unable to write journal");
+    }
+
+    // Function makes room for n bytes at the end of the current
+    // transaction and gives pointer to it.
+    byte* extend(std::size_t n) {
+
+        std::size_t pos = transaction.size();
+
+        transaction.resize(pos + n);
+
+        return (byte*) transaction.data() + pos;
+    }
+
+    // Body of the writer thread. Groups which could not be written
+    // are kept, but no other is written until the journal is cleared.
+    // All signals are blocked, so they reach the threads which wait
+    // for them, such as the daemon reading them through a descriptor.
+    void write_batches() {
+
+        sigset_t all;
+
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+        std::unique_lock<std::mutex> guard(lock);
+
+        while (true) {
+
+            if (batch.empty() || (failed && !stopping)) {
+
+                if (stopping)
+                    return;
+
+                queued.wait(guard);
+                continue;
+            }
+
+            if (!stopping && !flushing && batched < batch_transactions && clock_t::now() < first + batch_window) {
+                queued.wait_until(guard, first + batch_window);
+                continue;
+            }
+
+            std::string group;
+            uint64_t    group_end = ended;
+
+            group.swap(batch);
+            batched = 0;
+            writing = true;
+            guard.unlock();
+
+            bool done = true;
+
+            try {
+                write_all(group);
+            } catch (...) {
+                done = false;
+            }
+
+            guard.lock();
+            writing = false;
+            written.notify_all();
+
+            if (done) {
+                length += group.size();
+                synced  = group_end;
+                continue;
+            }
+
+            // Torn group is cut off, so later groups follow whole ones.
+            if (ftruncate(fd, length) < 0 || stopping)
+                return;
+
+            batch.insert(0, group);
+            failed = true;
+        }
+    }
+
+    static std::string encode_identity(const Journal_Identity& identity) {
+
+        byte header[identity_size];
+
+        write_uint(header, identity_magic, 4);
+        write_uint(header + 4, identity.version, 4);
+        write_uint(header + 8, identity.block_record, 4);
+        write_uint(header + 12, identity.indexes, 4);
+        write_uint(header + 16, identity.generation, 4);
+
+        return std::string((const char*) header, identity_size);
+    }
+
+    std::string read_all() const {
+
+        std::string content;
+        char        buffer[1 << 16];
+
+        while (true) {
+
+            ssize_t n = pread(fd, buffer, sizeof(buffer), content.size());
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n < 0)
+                throw std::runtime_error("Unable to read journal");
+
+            if (!n)
+                return content;
+
+            content.append(buffer, n);
+        }
+    }
+
+public:
+    explicit Journal(const std::string& file_name):
+            fd(-1), batched(0), writing(false), failed(false), stopping(false), flushing(0),
+            ended(0), synced(0), length(0) {
+
+        fd = open(file_name.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if (fd < 0)
+            throw std::runtime_error("Unable to open journal");
+
+        writer = std::thread(&Journal::write_batches, this);
+    }
+
+    Journal(const Journal&)            = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // Transactions still queued are written before the journal closes.
+    ~Journal() {
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+
+        queued.notify_one();
+        writer.join();
+        close(fd);
+    }
+
+    // Function calls apply(offset, bytes, n) for every range of the
+    // journal, transaction after transaction, up to the first one
+    // which is incomplete or damaged. Entry changes of directories
+    // which are not written back later are given in changes.
+    // An empty journal, or one torn while its identity was written,
+    // is given the identity of the image; a journal of another image
+    // is refused.
+    template <typename F>
+    void replay(const Journal_Identity& identity, F apply, entry_change_m& changes) {
+
+        std::string content = read_all();
+        std::string header  = encode_identity(identity);
+
+        if (content.size() < identity_size && !header.compare(0, content.size(), content)) {
+
+            if (ftruncate(fd, 0) < 0)
+                throw std::runtime_error("Unable to clear journal");
+
+            write_all(header);
+
+            std::lock_guard<std::mutex> guard(lock);
+
+            length = identity_size;
+
+            return;
+        }
+
+        if (content.compare(0, identity_size, header))
+            throw std::runtime_error("Journal does not belong to the file system image");
+
+        const byte* p   = (const byte*) content.data();
+        std::size_t pos = identity_size;
+
+        while (content.size() - pos >= header_size && read_uint(p + pos, 4) == magic) {
+
+            uint64_t size = read_uint(p + pos + 4, 8);
+            uint64_t sum  = read_uint(p + pos + 12, 8);
+
+            if (size > content.size() - pos - header_size || checksum(p + pos + header_size, size) != sum)
+                break;
+
+            const byte* record = p + pos + header_size;
+            const byte* end    = record + size;
+
+            while (record < end) {
+
+                Kind kind = (Kind) *record++;
+
+                if (kind == range) {
+
+                    std::size_t offset = read_uint(record, 8);
+                    ui          n      = read_uint(record + 8, 4);
+
+                    apply(offset, record + 12, n);
+                    record += 12 + n;
+
+                } else if (kind == entry) {
+
+                    index_t dir   = read_uint(record, 4);
+                    index_t inode = read_uint(record + 4, 4);
+                    ui      n     = read_uint(record + 8, 4);
+
+                    changes[dir].push_back({std::string((const char*) record + 12, n), inode});
+                    record += 12 + n;
+
+                } else {
+                    changes.erase(read_uint(record, 4));
+                    record += 4;
+                }
+            }
+
+            pos += header_size + size;
+        }
+
+        // Torn tail is cut off, so new transactions follow whole ones.
+        if (pos < content.size() && ftruncate(fd, pos) < 0)
+            throw std::runtime_error("Unable to clear journal");
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        length = pos;
+    }
+
+    // Adds n bytes of the image at offset to the current transaction.
+    void record(std::size_t offset, const byte* p, ui n) {
+
+        byte* out = extend(1 + 12 + n);
+
+        out[0] = range;
+        write_uint(out + 1, offset, 8);
+        write_uint(out + 9, n, 4);
+        memcpy(out + 13, p, n);
+    }
+
+    // Adds entry of the directory to the current transaction;
+    // inode 0 marks the entry as erased.
+    void record_entry(index_t dir, std::string_view name, index_t inode) {
+
+        byte* out = extend(1 + 12 + name.size());
+
+        out[0] = entry;
+        write_uint(out + 1, dir, 4);
+        write_uint(out + 5, inode, 4);
+        write_uint(out + 9, name.size(), 4);
+        name.copy((char*) out + 13, name.size());
+    }
+
+    // Records that entries of the directory logged so far no longer
+    // have to be replayed, as it is written back or erased.
+    void record_directory(index_t dir) {
+
+        byte* out = extend(1 + 4);
+
+        out[0] = directory;
+        write_uint(out + 1, dir, 4);
+    }
+
+    // Closes the current transaction and queues it for the writer.
+    // It gives number of the transaction to wait for; transaction
+    // without records is dropped and the last queued one is given.
+    uint64_t end_transaction() {
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (transaction.empty())
+            return ended;
+
+        byte header[header_size];
+
+        write_uint(header, magic, 4);
+        write_uint(header + 4, transaction.size(), 8);
+        write_uint(header + 12, checksum((const byte*) transaction.data(), transaction.size()), 8);
+
+        if (!batched++)
+            first = clock_t::now();
+
+        batch.append((const char*) header, header_size);
+        batch.append(transaction);
+        transaction.clear();
+
+        if (batched == 1 || batched == batch_transactions)
+            queued.notify_one();
+
+        return ++ended;
+    }
+
+    // Returns once the given transaction and all queued before it are
+    // written and synced. The writer does not wait for the batch window
+    // while anyone waits; transactions queued meanwhile are written
+    // along with it.
+    void wait(uint64_t number) {
+
+        std::unique_lock<std::mutex> guard(lock);
+
+        flushing++;
+        queued.notify_one();
+        written.wait(guard, [this, number] { return failed || synced >= number; });
+        flushing--;
+
+        if (synced < number)
+            throw std::runtime_error("Unable to write journal");
+    }
+
+    // Closes the current transaction and returns once it and all
+    // the others queued are written and synced.
+    void flush() {
+        wait(end_transaction());
+    }
+
+    // Throws if some queued transaction could not be written
+    // since the journal was last cleared.
+    void check() {
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (failed)
+            throw std::runtime_error("Unable to write journal");
+    }
+
+    // Self-explaining.
+    std::size_t size() {
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        return length + batch.size();
+    }
+
+    // Empties the journal once everything it holds is saved in the image.
+    // Only the identity of the image is kept.
+    void clear() {
+
+        std::unique_lock<std::mutex> guard(lock);
+
+        written.wait(guard, [this] { return !writing; });
+
+        if (length > identity_size && (ftruncate(fd, identity_size) < 0 || fdatasync(fd) < 0))
+            throw std::runtime_error("Unable to clear journal");
+
+        transaction.clear();
+        batch.clear();
+        batched = 0;
+        failed  = false;
+        synced  = ended;
+        length  = identity_size;
+    }
+
+};
+
+#endif //_FILE_SYSTEM_JOURNAL_H
@@ -1,42 +1,145 @@
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <vector>
 
+#include "daemon.h"
 #include "file_system.h"
 
 int main(int argc, char** argv){
 
     std::ifstream input;
-    std::ofstream output;
+
+    ui          block_size = Format::default_block_size;
+    long long   size       = 0;
+    std::string script;
+    std::string socket;
+    ui          workers    = std::thread::hardware_concurrency();
+    bool        lazy       = false;
+    bool        sync       = false;
+
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " file_system_file [--block-size 64|512|4096]"
+                  << " [--size bytes] [--script commands_file|-] [--serve socket_path [--workers n]] [--lazy-commit|--sync-commit]" << std::endl;
+        return 1;
+    }
+
+    for (int i = 2; i < argc; i++) {
+
+        std::string option = argv[i];
+
+        if (option == "--block-size" && i + 1 < argc)
+            block_size = strtoul(argv[++i], nullptr, 10);
+        else if (option == "--size" && i + 1 < argc)
+            size = strtoll(argv[++i], nullptr, 10);
+        else if (option == "--script" && i + 1 < argc)
+            script = argv[++i];
+        else if (option == "--serve" && i + 1 < argc)
+            socket = argv[++i];
+        else if (option == "--workers" && i + 1 < argc)
+            workers = strtoul(argv[++i], nullptr, 10);
+        else if (option == "--lazy-commit")
+            lazy = true;
+        else if (option == "--sync-commit")
+            sync = true;
+        else {
+            std::cerr << "Unrecognised option " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+
+    if (!Format::is_block_size_supported(block_size)) {
+        std::cerr << "Unsupported block size; Use 64, 512 or 4096" << std::endl;
+        return 1;
+    }
+
+    if (!script.empty() && !socket.empty()) {
+        std::cerr << "Use either --script or --serve" << std::endl;
+        return 1;
+    }
+
+    if (lazy && sync) {
+        std::cerr << "Use either --lazy-commit or --sync-commit" << std::endl;
+        return 1;
+    }
+
+    // Batch mode does not need standard streams synchronised
+    // with C streams, nor input and errors flushing the output
+    // before every read and message, which lets output be
+    // buffered, also while commands are read from cin. Commands
+    // of a script come one after another, so waiting for the
+    // journal sync of each would sync it once per command;
+    // they commit lazily unless --sync-commit is given.
+    if (!script.empty()) {
+        std::ios::sync_with_stdio(false);
+        std::cin.tie(nullptr);
+        std::cerr.tie(nullptr);
+        lazy = !sync;
+    }
 
     input = std::ifstream(argv[1]);
 
     if (!input) {
 
-        int size;
-        std::cout << "Specify the file system size in bytes: ";
-        std::cin >> size;
+        if (!size && (!script.empty() || !socket.empty())) {
+            std::cerr << "File system does not exist; Specify its size with --size" << std::endl;
+            return 1;
+        }
+
+        if (!size) {
+            std::cout << "Specify the file system size in bytes: ";
+            std::cin >> size;
+        }
 
         if (size > 0) {
 
-            output = std::ofstream(argv[1]);
-            File_System_Manager::make_empty_file_system(output, size);
+            try {
+                File_System_Manager::make_empty_file_system(argv[1], size, block_size);
+            } catch (const std::runtime_error& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+
             input = std::ifstream(argv[1]);
-            output.close();
         }
     }
 
     if (input) {
 
-        File_System system(input);
         input.close();
 
-        File_System_Manager::manage_file_system(system);
+        try {
+
+            Image       image(argv[1], lazy);
+            File_System system(image);
+
+            if (!socket.empty()) {
 
-        output = std::ofstream(argv[1]);
+                File_System_Daemon daemon(system, socket, workers);
 
-        system.dump_file_system_to_file(output);
-        output.close();
+                std::cerr << "Serving " << argv[1] << " on " << socket << std::endl;
+                daemon.run();
+
+            } else if (script.empty())
+                File_System_Manager::manage_file_system(system);
+            else if (script == "-")
+                File_System_Manager::run_script(system, std::cin);
+            else {
+
+                std::ifstream commands(script);
+
+                if (!commands)
+                    throw std::runtime_error("Unable to open script file");
+
+                File_System_Manager::run_script(system, commands);
+            }
+
+            system.sync();
+
+        } catch (const std::runtime_error& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
     }
 
     return 0;
@@ -1,173 +1,555 @@
 #ifndef _FILE_SYSTEM_MEMORY_BLOCKS_H
 #define _FILE_SYSTEM_MEMORY_BLOCKS_H
 
+#include <sys/uio.h>
+
+#include <climits>
+#include <memory>
+#include <ostream>
+
+#include "dirty_records.h"
+#include "format.h"
+#include "image.h"
+#include "utility.h"
+
+/**
+ * Layout of a memory block record known at compile time.
+ *
+ * Record starts with the next block number, followed by
+ * the amount of occupied content and the content itself.
+ */
+template <ui Record_Size, ui Index_Bytes, ui Occupied_Bytes, ui Content_Offset>
+struct Block_Geometry {
+
+    static const ui record_size       = Record_Size;
+    static const ui next_block_offset = 0;
+    static const ui index_bytes       = Index_Bytes;
+    static const ui occupied_offset   = Index_Bytes;
+    static const ui occupied_bytes    = Occupied_Bytes;
+    static const ui content_offset    = Content_Offset;
+    static const ui content_size      = Record_Size - Content_Offset;
+};
+
+using Legacy_Geometry   = Block_Geometry<53, 2, 1, 3>;
+using Wide_64_Geometry  = Block_Geometry<64, 4, 2, 8>;
+using Wide_512_Geometry = Block_Geometry<512, 4, 2, 8>;
+using Wide_4K_Geometry  = Block_Geometry<4096, 4, 2, 8>;
+
 /**
  *
  * Class storing memory of the file system.
  *
+ * All memory blocks live in one contiguous arena of
+ * packed records inside the mapped image: the next block
+ * number, the amount of occupied content and the content
+ * itself. Blocks are addressed by their offsets in the arena,
+ * so walking an extent reads memory strictly sequentially and
+ * content is moved with one copy per block.
+ *
+ * Size of the records is chosen when the image is created,
+ * so this class only describes operations on whole block lists;
+ * they are implemented by Fixed_Memory_Blocks specialized for
+ * every supported geometry and picked when the image is loaded.
  */
 class Memory_Blocks {
 
-private:
-    friend class File_System;
+protected:
+
+    static const ui max_vectors = IOV_MAX < 1024 ? IOV_MAX : 1024;
 
-    static const ui content_size = 50;
+    // Function writes all the buffers described by vectors into fd.
+    // Partially written buffers are resumed where the write stopped.
+    static void write_vectors(int fd, iovec* vectors, ui count) {
 
-    struct Memory_Block;
-    using mem_v = std::vector<Memory_Block>;
+        while (count) {
 
-    mem_v blocks;
+            ssize_t written = writev(fd, vectors, count);
 
-    struct Memory_Block {
+            if (written < 0 && errno == EINTR)
+                continue;
 
-        uint16_t next_block;
-        byte     occupied;
-        vec_c    content;
+            if (written < 0)
+                throw std::runtime_error("Unable to write file content");
 
-        explicit Memory_Block(std::ifstream& f) {
+            while (count && (std::size_t) written >= vectors->iov_len) {
+                written -= vectors->iov_len;
+                vectors++;
+                count--;
+            }
 
-            next_block = read_uint16_t(f);
-            occupied   = read_byte(f);
-            content    = read_string(f, content_size);
+            if (count) {
+                vectors->iov_base  = (char*) vectors->iov_base + written;
+                vectors->iov_len  -= written;
+            }
         }
+    }
+
+    // Function fills the buffers described by vectors with data read
+    // from fd. It gives amount of bytes read, which is smaller than
+    // the size of the buffers only if the input has ended.
+    static std::size_t read_vectors(int fd, iovec* vectors, ui count) {
+
+        std::size_t total = 0;
+
+        while (count) {
+
+            ssize_t got = readv(fd, vectors, count);
+
+            if (got < 0 && errno == EINTR)
+                continue;
+
+            if (got < 0)
+                throw std::runtime_error("Unable to read file content");
 
-        void dump_memory_block(std::ofstream& f) const {
+            if (!got)
+                break;
 
-                write_uint16_t(f, next_block);
-                write_byte(f, occupied);
-                write_string(f, content, content_size);
+            total += got;
+
+            while (count && (std::size_t) got >= vectors->iov_len) {
+                got -= vectors->iov_len;
+                vectors++;
+                count--;
+            }
+
+            if (count) {
+                vectors->iov_base  = (char*) vectors->iov_base + got;
+                vectors->iov_len  -= got;
+            }
         }
 
-        void clear_memory_block() {
+        return total;
+    }
+
+public:
+
+    virtual ~Memory_Blocks() = default;
+
+    // Gives memory blocks stored in the image, working on geometry given by format.
+    static std::unique_ptr<Memory_Blocks> load(Image_Cursor& c, index_t size, const Format& format);
+
+    virtual ui get_memory_block_size() const = 0;
+
+    // Function walks the block list starting at mem_start
+    // once and gathers it into extents of contiguous blocks.
+    virtual extent_v map_extents(index_t mem_start) const = 0;
+
+    // Function sums up content stored in the blocks.
+    virtual length_t content_length(const extent_v& extents) const = 0;
+
+    // Function properly saves content inside content vec into memory system blocks.
+    virtual void save_file(const extent_v& extents, const vec_c& content) = 0;
+
+    // Function writes size bytes of data at position to of the
+    // content stored in extents, which must already have enough
+    // blocks. Only blocks covering the written range are touched
+    // and each of them stays occupied at least up to its last written byte.
+    virtual void write_content(const extent_v& extents, Extent_Position to, const char* data, std::size_t size) = 0;
+
+    // Function copies size bytes of data into payloads of the blocks
+    // of extents, which must already be allocated, starting at
+    // position to. Headers are updated by mark_filled, so the copy
+    // may run while other blocks change.
+    virtual void copy_content(const extent_v& extents, Extent_Position to, const char* data, std::size_t size) const = 0;
+
+    // Function copies size bytes of the content stored in extents,
+    // starting at position from, into data. Blocks preceding
+    // the position are not visited.
+    virtual void read_content(const extent_v& extents, Extent_Position from, char* data, std::size_t size) const = 0;
+
+    // Function reads at most size bytes from fd straight into the
+    // blocks of extents, which must already be allocated, starting
+    // at position to. It gives amount of bytes read before the input ended.
+    // Only payloads are written; headers are updated by mark_filled,
+    // so the read may run while other blocks change.
+    virtual length_t read_from(const extent_v& extents, Extent_Position to, int fd, length_t size) const = 0;
+
+    // Function marks blocks holding size bytes starting at position
+    // from as occupied up to the last of these bytes.
+    virtual void mark_filled(const extent_v& extents, Extent_Position from, length_t size) = 0;
+
+    // Reports modified memory blocks to the image.
+    virtual void write_back(Image& image) = 0;
+
+    virtual void free_memory(const extent_v& extents) = 0;
+
+    // Function links next block after the last block of the list.
+    virtual void append_to_block_list(index_t last, index_t next) = 0;
+
+    virtual vec_c full_file_content(const extent_v& extents) = 0;
+
+    // Function writes content stored in extents into fd straight
+    // from the mapped image; payloads of consecutive blocks are
+    // gathered into one writev call.
+    virtual void stream_content(const extent_v& extents, int fd) const = 0;
+
+    // Function writes content stored in extents into out, a block at a time.
+    virtual void stream_content(const extent_v& extents, std::ostream& out) const = 0;
+
+    // Function ends the block list at new_last, cutting off
+    // the detached blocks following it, which are cleared.
+    virtual void detach_from_block_list(index_t new_last, const extent_v& detached) = 0;
+
+    // Function shrinks content held by the block to occupied bytes.
+    virtual void shrink_block(index_t mem_block, ui occupied) = 0;
+
+};
+
+/**
+ * Memory blocks of one geometry.
+ *
+ * Record layout is a template parameter, so offsets, widths
+ * and the content size are constants in all the loops below.
+ */
+template <typename Geometry>
+class Fixed_Memory_Blocks : public Memory_Blocks {
+
+private:
+
+    static const ui content_size = Geometry::content_size;
+    static const ui record_size  = Geometry::record_size;
+
+    byte*         arena;
+    Dirty_Records dirty;
+
+    static std::size_t record_offset(index_t n) {
+        return (std::size_t) n * record_size;
+    }
+
+    byte* block(index_t n) const {
+        return arena + record_offset(n);
+    }
+
+    index_t next_block(index_t n) const {
+        return read_uint(block(n) + Geometry::next_block_offset, Geometry::index_bytes);
+    }
+
+    void set_next_block(index_t n, index_t next) {
+        write_uint(block(n) + Geometry::next_block_offset, next, Geometry::index_bytes);
+        dirty.mark(n);
+    }
+
+    ui occupied(index_t n) const {
+        return read_uint(block(n) + Geometry::occupied_offset, Geometry::occupied_bytes);
+    }
+
+    void set_occupied(index_t n, ui occupied) {
+        write_uint(block(n) + Geometry::occupied_offset, occupied, Geometry::occupied_bytes);
+        dirty.mark(n);
+    }
+
+    char* payload(index_t n) const {
+        return (char*) block(n) + Geometry::content_offset;
+    }
+
+    void clear_memory_block(index_t n) {
+        memset(block(n), 0, record_size);
+        dirty.mark(n);
+    }
+
+    // Function reads data from fd into the vectors. Bytes read are added
+    // to total. It gives false if the input ended before all were filled.
+    static bool fill_vectors(int fd, iovec* vectors, ui count, length_t& total) {
+
+        std::size_t wanted = 0;
+        std::size_t got    = read_vectors(fd, vectors, count);
+
+        for (ui k = 0; k < count; k++)
+            wanted += vectors[k].iov_len;
+
+        total += got;
+
+        return got == wanted;
+    }
 
-            next_block = 0;
-            occupied   = 0;
+    // Function appends content of the blocks to content vector.
+    // Headers are summed up first, so the vector grows only once.
+    void fill_content_with_memory_chunk(const extent_v& extents, vec_c& content) {
 
-            for (ui i = 0; i < content_size; i++)
-                content[i] = '\0';
+        std::size_t length = content.size();
+
+        content.resize(length + content_length(extents));
+
+        for (auto const& e : extents) {
+            for (index_t mem_block = e.start; mem_block < e.start + e.length; mem_block++) {
+
+                std::copy_n(payload(mem_block), occupied(mem_block), content.begin() + length);
+                length += occupied(mem_block);
+            }
         }
+    }
+
+public:
 
-    };
+    explicit Fixed_Memory_Blocks(Image_Cursor& c, index_t size): arena(c.take(record_offset(size))), dirty(size) {}
 
-    void fill_content_with_memory_chunk(uint16_t mem_start, vec_c& content) {
+    ui get_memory_block_size() const override {
+        return content_size;
+    }
 
-        do {
+    extent_v map_extents(index_t mem_start) const override {
 
-            uint16_t block_idx = 0;
+        extent_v extents;
 
-            while (block_idx < blocks[mem_start].occupied)
-                content.push_back(blocks[mem_start].content[block_idx++]);
+        do {
 
-            mem_start = blocks[mem_start].next_block;
+            if (!extents.empty() && extents.back().start + extents.back().length == mem_start)
+                extents.back().length++;
+            else
+                extents.push_back({mem_start, 1});
+
+            mem_start = next_block(mem_start);
 
         } while (mem_start);
+
+        return extents;
     }
 
-public:
+    length_t content_length(const extent_v& extents) const override {
 
-    explicit Memory_Blocks(std::ifstream& f, uint16_t size) {
+        length_t length = 0;
 
-        for (uint16_t i = 0; i < size; i++)
-            blocks.push_back(Memory_Block(f));
+        for (auto const& e : extents)
+            for (index_t mem_block = e.start; mem_block < e.start + e.length; mem_block++)
+                length += occupied(mem_block);
+
+        return length;
     }
 
-    static ui get_memory_block_size() {
-        return content_size;
+    void save_file(const extent_v& extents, const vec_c& content) override {
+
+        std::size_t con_idx = 0;
+
+        for (auto const& e : extents) {
+            for (index_t mem_block = e.start; mem_block < e.start + e.length; mem_block++) {
+
+                ui chunk = std::min((std::size_t) content_size, content.size() - con_idx);
+
+                std::copy_n(content.begin() + con_idx, chunk, payload(mem_block));
+                set_occupied(mem_block, chunk);
+                con_idx += chunk;
+            }
+        }
     }
 
-    // Function properly saves content inside content vec into memory system blocks.
-    void save_file(uint16_t mem_block, const vec_c& content) {
+    void write_content(const extent_v& extents, Extent_Position to, const char* data, std::size_t size) override {
 
-        uint16_t con_idx     = 0;
-        uint16_t mem_idx     = 0;
+        index_t mem_block = extents[to.extent].start + to.offset / content_size;
+        ui      offset    = to.offset % content_size;
 
-        while (con_idx < content.size()) {
+        for (std::size_t i = to.extent; size && i < extents.size(); i++) {
 
-                if (mem_idx == content_size) {
+            if (i != to.extent)
+                mem_block = extents[i].start;
 
-                    mem_idx = 0;
-                    blocks[mem_block].occupied = (byte) content_size;
-                    mem_block = blocks[mem_block].next_block;
-                }
+            for (; size && mem_block < extents[i].start + extents[i].length; mem_block++) {
+
+                ui chunk = std::min((std::size_t) content_size - offset, size);
+
+                memcpy(payload(mem_block) + offset, data, chunk);
+                set_occupied(mem_block, std::max(occupied(mem_block), offset + chunk));
 
-                blocks[mem_block].content[mem_idx++] = content[con_idx++];
+                data  += chunk;
+                size  -= chunk;
+                offset = 0;
+            }
         }
+    }
+
+    void copy_content(const extent_v& extents, Extent_Position to, const char* data, std::size_t size) const override {
+
+        index_t mem_block = extents[to.extent].start + to.offset / content_size;
+        ui      offset    = to.offset % content_size;
+
+        for (std::size_t i = to.extent; size && i < extents.size(); i++) {
+
+            if (i != to.extent)
+                mem_block = extents[i].start;
 
-        blocks[mem_block].occupied = (byte) mem_idx;
+            for (; size && mem_block < extents[i].start + extents[i].length; mem_block++) {
+
+                ui chunk = std::min((std::size_t) content_size - offset, size);
+
+                memcpy(payload(mem_block) + offset, data, chunk);
+
+                data  += chunk;
+                size  -= chunk;
+                offset = 0;
+            }
+        }
     }
 
+    void read_content(const extent_v& extents, Extent_Position from, char* data, std::size_t size) const override {
+
+        index_t mem_block = extents[from.extent].start + from.offset / content_size;
+        ui      offset    = from.offset % content_size;
+
+        for (std::size_t i = from.extent; size && i < extents.size(); i++) {
+
+            if (i != from.extent)
+                mem_block = extents[i].start;
+
+            for (; size && mem_block < extents[i].start + extents[i].length; mem_block++) {
+
+                ui chunk = std::min((std::size_t) occupied(mem_block) - offset, size);
 
-    void dump_memory_blocks_to_file(std::ofstream& f) {
+                memcpy(data, payload(mem_block) + offset, chunk);
 
-        for (auto& block : blocks)
-            block.dump_memory_block(f);
+                data  += chunk;
+                size  -= chunk;
+                offset = 0;
+            }
+        }
     }
 
+    length_t read_from(const extent_v& extents, Extent_Position to, int fd, length_t size) const override {
 
-    vec_16 free_memory(uint16_t n) {
+        iovec    vectors[max_vectors];
+        ui       count = 0;
+        length_t total = 0;
 
-        vec_16 freed_blocks;
+        index_t mem_block = extents[to.extent].start + to.offset / content_size;
+        ui      offset    = to.offset % content_size;
 
-        do {
+        for (std::size_t i = to.extent; size && i < extents.size(); i++) {
+
+            if (i != to.extent)
+                mem_block = extents[i].start;
+
+            for (; size && mem_block < extents[i].start + extents[i].length; mem_block++) {
+
+                ui chunk = std::min<length_t>(content_size - offset, size);
 
-            freed_blocks.push_back(n);
-            uint16_t next_block  = blocks[n].next_block;
-            blocks[n].clear_memory_block();
-            n = next_block;
-        } while (n);
+                vectors[count] = {payload(mem_block) + offset, chunk};
 
-        return freed_blocks;
+                size  -= chunk;
+                offset = 0;
+
+                if (++count == max_vectors) {
+
+                    if (!fill_vectors(fd, vectors, count, total))
+                        return total;
+
+                    count = 0;
+                }
+            }
+        }
+
+        fill_vectors(fd, vectors, count, total);
+
+        return total;
     }
 
-    uint16_t get_file_size(uint16_t start) {
+    void mark_filled(const extent_v& extents, Extent_Position from, length_t size) override {
 
-        uint16_t size = 0;
+        index_t mem_block = extents[from.extent].start + from.offset / content_size;
+        ui      offset    = from.offset % content_size;
 
-        do {
+        for (std::size_t i = from.extent; size && i < extents.size(); i++) {
+
+            if (i != from.extent)
+                mem_block = extents[i].start;
+
+            for (; size && mem_block < extents[i].start + extents[i].length; mem_block++) {
 
-            size += content_size;
-            start = blocks[start].next_block;
-        } while (start);
+                ui chunk = std::min<length_t>(content_size - offset, size);
 
-        return size;
+                set_occupied(mem_block, std::max(occupied(mem_block), offset + chunk));
+
+                size  -= chunk;
+                offset = 0;
+            }
+        }
     }
 
-    void append_to_block_list(uint16_t start, uint16_t next) {
+    void write_back(Image& image) override {
 
-        while (blocks[start].next_block)
-            start = blocks[start].next_block;
+        for (auto idx : dirty.get_indexes())
+            image.mark_dirty(block(idx), record_size);
 
-        blocks[start].next_block = next;
-        blocks[next].clear_memory_block();
+        dirty.clear();
     }
 
-    vec_c full_file_content(uint16_t mem_start) {
+    void free_memory(const extent_v& extents) override {
+
+        for (auto const& e : extents)
+            for (index_t mem_block = e.start; mem_block < e.start + e.length; mem_block++)
+                clear_memory_block(mem_block);
+    }
+
+    void append_to_block_list(index_t last, index_t next) override {
+
+        set_next_block(last, next);
+        clear_memory_block(next);
+    }
+
+    vec_c full_file_content(const extent_v& extents) override {
 
         vec_c content;
-        fill_content_with_memory_chunk(mem_start, content);
+        fill_content_with_memory_chunk(extents, content);
 
         return content;
     }
 
-    uint16_t erase_from_block_list(uint16_t start) {
+    void stream_content(const extent_v& extents, int fd) const override {
+
+        iovec vectors[max_vectors];
+        ui    count = 0;
 
-        uint16_t n_start = blocks[start].next_block;
+        for (auto const& e : extents) {
+            for (index_t mem_block = e.start; mem_block < e.start + e.length; mem_block++) {
 
-        if (!n_start)
-            throw std::runtime_error("CRITICAL ERROR. Trying to shrink directory into 0 blocks but directory still exists");
+                if (!occupied(mem_block))
+                    continue;
 
-        while (blocks[n_start].next_block) {
+                vectors[count++] = {payload(mem_block), occupied(mem_block)};
 
-            start   = n_start;
-            n_start = blocks[n_start].next_block;
+                if (count == max_vectors) {
+                    write_vectors(fd, vectors, count);
+                    count = 0;
+                }
+            }
         }
 
-        blocks[start].next_block = 0;
-        blocks[n_start].clear_memory_block();
+        write_vectors(fd, vectors, count);
+    }
+
+    void stream_content(const extent_v& extents, std::ostream& out) const override {
+
+        for (auto const& e : extents)
+            for (index_t mem_block = e.start; mem_block < e.start + e.length; mem_block++)
+                out.write(payload(mem_block), occupied(mem_block));
+    }
+
+    void detach_from_block_list(index_t new_last, const extent_v& detached) override {
+
+        set_next_block(new_last, 0);
+        free_memory(detached);
+    }
+
+    void shrink_block(index_t mem_block, ui size) override {
 
-        return n_start;
+        if (occupied(mem_block) > size)
+            set_occupied(mem_block, size);
     }
 
 };
 
+std::unique_ptr<Memory_Blocks> Memory_Blocks::load(Image_Cursor& c, index_t size, const Format& format) {
+
+    if (format.version == Format::legacy_version)
+        return std::unique_ptr<Memory_Blocks>(new Fixed_Memory_Blocks<Legacy_Geometry>(c, size));
+
+    switch (format.block_record()) {
+        case Wide_64_Geometry::record_size:
+            return std::unique_ptr<Memory_Blocks>(new Fixed_Memory_Blocks<Wide_64_Geometry>(c, size));
+        case Wide_512_Geometry::record_size:
+            return std::unique_ptr<Memory_Blocks>(new Fixed_Memory_Blocks<Wide_512_Geometry>(c, size));
+        case Wide_4K_Geometry::record_size:
+            return std::unique_ptr<Memory_Blocks>(new Fixed_Memory_Blocks<Wide_4K_Geometry>(c, size));
+        default:
+            throw std::runtime_error("Unsupported file system block size");
+    }
+}
+
 #endif //_FILE_SYSTEM_MEMORY_BLOCKS_H
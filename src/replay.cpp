@@ -0,0 +1,162 @@
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "file_system.h"
+
+// Test of replaying the journal when the image is loaded.
+//
+// A session which ends without saving the image (as if the process
+// was killed) leaves its changes in the journal only; loading the image
+// again has to bring all of them back. A journal left beside an image
+// which is then created anew must not be replayed into the new image,
+// whatever its block size, and a journal of another image is refused.
+// Lastly a directory filled until the image has no free space left has
+// to be loaded again and saved.
+
+static bool ok = true;
+
+static void expect(bool condition, const std::string& what) {
+
+    if (!condition) {
+        std::cerr << what << std::endl;
+        ok = false;
+    }
+}
+
+static std::string content_of(File_System& system, const path_v& path, std::string_view name) {
+
+    vec_c content = system.read(path, name, 0, 1 << 20);
+
+    return std::string(content.begin(), content.end());
+}
+
+static std::string listing_of(File_System& system) {
+
+    std::ostringstream out;
+
+    system.cat({}, "/", out);
+
+    return out.str();
+}
+
+static std::string read_file(const std::string& name) {
+
+    std::ifstream      in(name, std::ios::binary);
+    std::ostringstream content;
+
+    content << in.rdbuf();
+
+    return content.str();
+}
+
+static void write_file(const std::string& name, const std::string& content) {
+    std::ofstream(name, std::ios::binary) << content;
+}
+
+// Changes are made and the session ends without saving the image.
+static void crash_after_changes(const std::string& name) {
+
+    Image       image(name);
+    File_System system(image);
+
+    system.mkdir({}, "olddir");
+    system.add_file({"olddir"}, "secret");
+    system.write_to_file({"olddir"}, "secret", "journaled content");
+    system.write_at({"olddir"}, "secret", 0, "J");
+    system.add_file({}, "gone");
+    system.erase({}, "gone");
+}
+
+static void test_replay(const std::string& name) {
+
+    File_System_Manager::make_empty_file_system(name, 1 << 20, Format::default_block_size);
+    std::string empty = read_file(name);
+
+    crash_after_changes(name);
+
+    expect(read_file(name) == empty, "Image changed without being saved");
+
+    Image       image(name);
+    File_System system(image);
+
+    expect(listing_of(system) == "olddir\n", "Replayed root directory differs");
+    expect(content_of(system, {"olddir"}, "secret") == "Journaled content", "Replayed file content differs");
+}
+
+static void test_recreated_image(const std::string& name) {
+
+    File_System_Manager::make_empty_file_system(name, 1 << 20, Format::default_block_size);
+    crash_after_changes(name);
+    File_System_Manager::make_empty_file_system(name, 1 << 20, 512);
+
+    Image       image(name);
+    File_System system(image);
+
+    expect(listing_of(system).empty(), "Journal of the old image replayed into the new one");
+}
+
+static void test_foreign_journal(const std::string& name) {
+
+    File_System_Manager::make_empty_file_system(name, 1 << 20, Format::default_block_size);
+    crash_after_changes(name);
+
+    std::string journal = read_file(Image::journal_name(name));
+
+    File_System_Manager::make_empty_file_system(name, 1 << 20, Format::default_block_size);
+    write_file(Image::journal_name(name), journal);
+
+    try {
+        Image       image(name);
+        File_System system(image);
+        expect(false, "Journal of another image accepted");
+    } catch (const std::runtime_error&) {}
+}
+
+static void test_full_directory(const std::string& name) {
+
+    File_System_Manager::make_empty_file_system(name, 40000, Format::default_block_size);
+
+    {
+        Image       image(name);
+        File_System system(image);
+
+        system.mkdir({}, "d");
+
+        try {
+            for (ui i = 0; ; i++)
+                system.add_file({"d"}, "file_with_long_name_" + std::to_string(i));
+        } catch (const std::runtime_error&) {}
+    }
+
+    Image              image(name);
+    File_System        system(image);
+    std::ostringstream out;
+
+    system.memory_info(out);
+    system.sync();
+}
+
+int main(int argc, char** argv){
+
+    std::string name = argc > 1 ? argv[1] : "replay.img";
+
+    for (auto test : {test_replay, test_recreated_image, test_foreign_journal, test_full_directory}) {
+
+        try {
+            test(name);
+        } catch (const std::runtime_error& e) {
+            std::cerr << e.what() << std::endl;
+            ok = false;
+        }
+    }
+
+    unlink(name.c_str());
+    unlink(Image::journal_name(name).c_str());
+
+    std::cout << (ok ? "Replay test passed" : "Replay test failed") << std::endl;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,218 @@
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "file_system.h"
+
+// Stress test of File_System called from many threads.
+//
+// Writers change files of their own directories (appends, positional
+// writes, cuts, links and short-lived files, which they also try to
+// create again) while readers keep reading
+// all of them. Afterwards the image is loaded again and the content of
+// every file is compared with what its writer did. Then everything is
+// erased and the image has to account for exactly as many free blocks
+// and inodes as a freshly created one.
+
+static const ui writers = 4;
+static const ui readers = 4;
+
+static std::string record(ui writer, ui i) {
+    return std::to_string(writer) + ":" + std::to_string(i) + ";";
+}
+
+// Gives content the writer leaves in its file after ops operations.
+static std::string expected_content(ui writer, ui ops) {
+
+    std::string content;
+
+    for (ui i = 0; i < ops; i++) {
+
+        content += record(writer, i);
+
+        if (i % 97 == 0)
+            content[0] = 'H';
+
+        if (i % 333 == 0)
+            content.back() = '.';
+    }
+
+    return content;
+}
+
+static void write_files(File_System& system, ui writer, ui ops) {
+
+    std::string dir  = "d" + std::to_string(writer);
+    std::string file = "f" + std::to_string(writer);
+    path_v      path = {dir};
+
+    for (ui i = 0; i < ops; i++) {
+
+        system.write_to_file(path, file, record(writer, i));
+
+        if (i % 97 == 0)
+            system.write_at(path, file, 0, "H");
+
+        if (i % 333 == 0) {
+            system.cut(path, file, 1);
+            system.write_to_file(path, file, ".");
+        }
+
+        if (i % 50 == 0) {
+
+            std::string temp = "t" + std::to_string(i);
+
+            system.add_file(path, temp);
+
+            try {
+                system.mkdir(path, temp);
+                throw std::logic_error("Existing name created again");
+            } catch (const std::runtime_error&) {}
+
+            system.write_to_file(path, temp, std::string(300, 'z'));
+            system.link(path, temp, path, "l" + std::to_string(i));
+
+            if (i % 100 == 0) {
+                system.erase(path, temp);
+                system.erase(path, "l" + std::to_string(i));
+            }
+        }
+    }
+}
+
+// Readers yield after every round, so writers are not starved
+// on machines with few processors.
+static void read_files(File_System& system, const std::atomic<bool>& done, bool with_info) {
+
+    int devnull = open("/dev/null", O_WRONLY);
+
+    while (!done) {
+
+        for (ui w = 0; w < writers; w++) {
+
+            std::string dir  = "d" + std::to_string(w);
+            std::string file = "f" + std::to_string(w);
+
+            system.read({dir}, file, 0, 1 << 20);
+            system.get_file_content({dir}, file, devnull);
+
+            if (with_info) {
+                std::ostringstream out;
+                system.info({}, "/", out);
+            }
+        }
+
+        std::this_thread::yield();
+    }
+
+    close(devnull);
+}
+
+static std::string usage_of(File_System& system) {
+
+    std::ostringstream out;
+
+    system.memory_info(out);
+    system.inodes_info(out);
+
+    return out.str();
+}
+
+static void make_image(const std::string& name, uint64_t size) {
+    File_System_Manager::make_empty_file_system(name, size, Format::default_block_size);
+}
+
+int main(int argc, char** argv){
+
+    std::string name  = argc > 1 ? argv[1] : "stress.img";
+    ui          ops   = argc > 2 ? strtoul(argv[2], nullptr, 10) : 20000;
+    uint64_t    size  = 1 << 24;
+    std::string fresh = name + ".fresh";
+    bool        ok    = true;
+
+    try {
+
+        make_image(name, size);
+        make_image(fresh, size);
+
+        {
+            Image             image(name);
+            File_System       system(image);
+            std::atomic<bool> done(false);
+            std::vector<std::thread> threads;
+
+            for (ui w = 0; w < writers; w++) {
+                system.mkdir({}, "d" + std::to_string(w));
+                system.add_file({"d" + std::to_string(w)}, "f" + std::to_string(w));
+            }
+
+            for (ui w = 0; w < writers; w++)
+                threads.emplace_back(write_files, std::ref(system), w, ops);
+
+            for (ui r = 0; r < readers; r++)
+                threads.emplace_back(read_files, std::ref(system), std::cref(done), r == 0);
+
+            for (ui w = 0; w < writers; w++)
+                threads[w].join();
+
+            done = true;
+
+            for (ui r = 0; r < readers; r++)
+                threads[writers + r].join();
+
+            system.sync();
+        }
+
+        {
+            Image       image(name);
+            File_System system(image);
+
+            for (ui w = 0; w < writers; w++) {
+
+                std::string dir     = "d" + std::to_string(w);
+                vec_c       content = system.read({dir}, "f" + std::to_string(w), 0, 1 << 30);
+
+                if (std::string(content.begin(), content.end()) != expected_content(w, ops)) {
+                    std::cerr << "Content of " << dir << "/f" << w << " differs" << std::endl;
+                    ok = false;
+                }
+
+                for (ui i = 50; i < ops; i += 100) {
+                    system.erase({dir}, "t" + std::to_string(i));
+                    system.erase({dir}, "l" + std::to_string(i));
+                }
+
+                system.erase({dir}, "f" + std::to_string(w));
+                system.erase({}, dir);
+            }
+
+            system.sync();
+        }
+
+        Image       image(name);
+        File_System system(image);
+        Image       fresh_image(fresh);
+        File_System fresh_system(fresh_image);
+
+        if (usage_of(system) != usage_of(fresh_system)) {
+            std::cerr << "Erased image does not free all blocks and inodes:" << std::endl
+                      << usage_of(system) << "Fresh image:" << std::endl << usage_of(fresh_system);
+            ok = false;
+        }
+
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        ok = false;
+    }
+
+    for (auto const& file : {name, name + ".journal", fresh, fresh + ".journal"})
+        unlink(file.c_str());
+
+    std::cout << (ok ? "Stress test passed" : "Stress test failed") << std::endl;
+
+    return ok ? 0 : 1;
+}
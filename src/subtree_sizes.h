@@ -0,0 +1,117 @@
+#ifndef _FILE_SYSTEM_SUBTREE_SIZES_H
+#define _FILE_SYSTEM_SUBTREE_SIZES_H
+
+#include "utility.h"
+
+/**
+ * Class maintaining aggregates of directory subtrees.
+ *
+ * For every directory whose subtree has been summed up once
+ * (such directory is called valid) it keeps the amount of bytes,
+ * files and subdirectories of the whole subtree. Later changes
+ * are applied as deltas to the directory they happen in and to
+ * all of its ancestors, so the aggregates never have to be
+ * recomputed. Descendants of a valid directory are always valid
+ * and for every file the list of valid directories containing it
+ * is kept, so a change of a file length reaches every directory
+ * which counts it, including these holding links to it.
+ * Entries live in paged tables, so only pages of inodes
+ * which have been used take memory.
+ */
+class Subtree_Sizes {
+
+public:
+
+    struct Subtree {
+
+        bool     valid;
+        index_t  parent;
+        length_t bytes;
+        ui       files;
+        ui       dirs;
+    };
+
+private:
+
+    Paged_Table<Subtree> subtrees;     // Indexed by directory inode.
+    Paged_Table<vec_i>   parents;      // Valid directories containing the file.
+
+public:
+    explicit Subtree_Sizes(index_t size): subtrees(size, Subtree{false, 0, 0, 0, 0}), parents(size, {}) {}
+
+    bool is_valid(index_t dir) const {
+        return subtrees.get(dir).valid;
+    }
+
+    const Subtree& get(index_t dir) const {
+        return subtrees.get(dir);
+    }
+
+    void set_parent(index_t dir, index_t parent) {
+        subtrees.edit(dir).parent = parent;
+    }
+
+    void set(index_t dir, length_t bytes, ui files, ui dirs) {
+
+        auto& s = subtrees.edit(dir);
+
+        s.valid = true;
+        s.bytes = bytes;
+        s.files = files;
+        s.dirs  = dirs;
+    }
+
+    // Function forgets aggregate of the directory which is being erased.
+    void forget(index_t dir) {
+        subtrees.edit(dir) = Subtree{false, 0, 0, 0, 0};
+    }
+
+    void add_file_parent(index_t file, index_t dir) {
+
+        if (is_valid(dir))
+            parents.edit(file).push_back(dir);
+    }
+
+    void remove_file_parent(index_t file, index_t dir) {
+
+        auto& p = parents.edit(file);
+
+        for (ui i = 0; i < p.size(); i++) {
+            if (p[i] == dir) {
+                p[i] = p.back();
+                p.pop_back();
+                return;
+            }
+        }
+    }
+
+    // Function applies deltas to the directory and all its
+    // valid ancestors, up to the root directory.
+    void propagate(index_t dir, long bytes, int files, int dirs) {
+
+        while (is_valid(dir)) {
+
+            auto& s = subtrees.edit(dir);
+
+            s.bytes += bytes;
+            s.files += files;
+            s.dirs  += dirs;
+
+            if (!dir)
+                break;
+
+            dir = s.parent;
+        }
+    }
+
+    // Function applies change of a file length to every
+    // directory counting the file.
+    void file_changed(index_t file, long bytes) {
+
+        for (auto dir : parents.get(file))
+            propagate(dir, bytes, 0, 0);
+    }
+
+};
+
+#endif //_FILE_SYSTEM_SUBTREE_SIZES_H
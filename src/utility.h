@@ -1,227 +1,315 @@
 #ifndef _FILE_SYSTEM_UTILITY_H
 #define _FILE_SYSTEM_UTILITY_H
 
-using ui     = unsigned int;
-using byte   = unsigned char;
-using vec_s  = std::vector<std::string>;
-using vec_16 = std::vector<uint16_t>;
-using vec_c  = std::vector<char>;
+#include <memory>
+#include <string_view>
+
+using ui       = unsigned int;
+using byte     = unsigned char;
+using index_t  = uint32_t;      // Number of an inode or a memory block.
+using length_t = uint64_t;      // Length of a file or directory content.
+using vec_s    = std::vector<std::string>;
+using path_v   = std::vector<std::string_view>;
+using vec_i    = std::vector<index_t>;
+using vec_c    = std::vector<char>;
+
+// Run of contiguous memory blocks belonging to one file.
+struct Extent {
+    index_t start;
+    index_t length;
+};
 
+using extent_v = std::vector<Extent>;
 
-uint16_t read_uint16_t(std::ifstream& f);
-uint16_t read_uint16_t(const vec_c& buffer, uint16_t pos);
+// Position inside content stored in extents: the extent
+// and the byte offset counted from its first block.
+struct Extent_Position {
+    std::size_t extent;
+    length_t    offset;
+};
 
-void     write_uint16_t(std::ostream& f, uint16_t val);
-byte     read_byte(std::ifstream& f);
 
-struct Directory {
+/**
+ * Table of per-inode entries allocated a page at a time.
+ *
+ * A page is allocated once any of its entries is changed, so
+ * a table covering every inode of the image only costs memory
+ * for inodes which have been used. Entries of pages which do
+ * not exist yet read as the initial value. Pages never move,
+ * so references to entries stay valid.
+ */
+template <typename T>
+class Paged_Table {
 
-    uint16_t inode_num;     // Inode number of the directory.
-    uint16_t mem_block;     // First block of the directory.
-    vec_s    names;         // Name of the file
-    vec_16   inodes;        // Directly mapped onto the inode number.
+private:
 
+    static const ui page_bits = 10;
+    static const ui page_size = 1 << page_bits;
 
-    explicit Directory(uint16_t inode_nr, uint16_t mem_block, const vec_c& dir_content):
-                      inode_num(inode_nr), mem_block(mem_block) {
+    std::vector<std::unique_ptr<T[]>> pages;
+    T                                 initial;
 
-        uint16_t read = 0;
+public:
+    explicit Paged_Table(std::size_t size, T value):
+            pages((size + page_size - 1) >> page_bits), initial(std::move(value)) {}
 
-        while (read < dir_content.size()) {
+    const T& get(std::size_t i) const {
 
-            std::string s;
+        auto const& page = pages[i >> page_bits];
 
-            while (dir_content[read] != '\0')
-                s.append(1, dir_content[read++]);
+        return page ? page[i & (page_size - 1)] : initial;
+    }
 
-            names.push_back(s);
-            inodes.push_back(read_uint16_t(dir_content, ++read));
+    // Gives entry to be changed, allocating its page first.
+    T& edit(std::size_t i) {
 
-            read += 2;
+        auto& page = pages[i >> page_bits];
+
+        if (!page) {
+            page.reset(new T[page_size]);
+            std::fill(page.get(), page.get() + page_size, initial);
         }
 
+        return page[i & (page_size - 1)];
     }
 
-    void add_new_file(const std::string& s, uint16_t inode) {
+};
 
-        for (auto const& name : names)
-            if (name == s)
-                throw std::runtime_error("File already exists");
 
-        names.push_back(s);
-        inodes.push_back(inode);
-    }
+uint64_t read_uint(const byte* p, ui bytes);
+void     write_uint(byte* p, uint64_t val, ui bytes);
 
-    uint16_t get_file_inode(const std::string& s) const {
+/**
+ * Hash index of directory file names.
+ *
+ * Open-addressing table with linear probing mapping
+ * a file name onto its slot in the directory names vector.
+ * Entries store slot + 1, so 0 marks an empty entry.
+ * Table is kept at most half full.
+ */
+class Name_Index {
 
-        ui idx;
+private:
 
-        for (idx = 0; idx < names.size() && names[idx] != s; idx++) {}
+    std::vector<ui> table;
+    ui              entries;
 
-        return idx == names.size() ? 0 : inodes[idx];
+    static std::size_t hash(const char* s, std::size_t n) {
+
+        std::size_t h = 14695981039346656037ULL;
+
+        for (std::size_t i = 0; i < n; i++)
+            h = (h ^ (byte) s[i]) * 1099511628211ULL;
+
+        return h;
     }
 
-    void print_content() const {
-        for (auto const & s : names)
-            std::cout << s << std::endl;
+    ui home(const vec_s& names, ui slot) const {
+        return hash(names[slot].data(), names[slot].size()) & (table.size() - 1);
     }
 
-    void erase_file(const std::string& s) {
-        vec_s::iterator  i;
-        vec_16::iterator i_1;
+    void place(const vec_s& names, ui slot) {
 
-        for (i = names.begin(), i_1 = inodes.begin(); i != names.end() && i_1 != inodes.end(); i++, i_1++)
-            if (*i == s)
-                break;
+        ui i = home(names, slot);
 
-        if (i == names.end())
-            throw std::runtime_error("File not found");
+        while (table[i])
+            i = (i + 1) & (table.size() - 1);
 
-        names.erase(i);
-        inodes.erase(i_1);
+        table[i] = slot + 1;
     }
 
-    vec_c get_directory_content() const {
+public:
+    Name_Index(): table(8, 0), entries(0) {}
 
-        vec_c content;
+    // Function builds the index from scratch.
+    void rebuild(const vec_s& names) {
 
-        for (ui i = 0; i < names.size(); i++) {
+        ui capacity = 8;
 
-            for (auto c : names[i])
-                content.push_back(c);
+        while (capacity < 2 * names.size() + 2)
+            capacity *= 2;
 
-            content.push_back('\0');
-            content.push_back((char) inodes[i]);
-            content.push_back((char) inodes[i] >> 8);
-        }
+        table.assign(capacity, 0);
+        entries = names.size();
 
-        return content;
+        for (ui slot = 0; slot < names.size(); slot++)
+            place(names, slot);
     }
 
-};
+    // Function gives slot of the name or names.size() if it is absent.
+    ui find(const vec_s& names, const char* s, std::size_t n) const {
 
-struct File {
+        for (ui i = hash(s, n) & (table.size() - 1); table[i]; i = (i + 1) & (table.size() - 1)) {
 
-    uint16_t mem_block;
-    vec_c    content;
+            auto const& name = names[table[i] - 1];
 
-    explicit File(uint16_t m_b, vec_c& c): mem_block(m_b), content(c) {}
+            if (name.size() == n && !memcmp(name.data(), s, n))
+                return table[i] - 1;
+        }
 
-    void print_content() const {
+        return names.size();
+    }
 
-        for (auto& c : content)
-            std::cout << c;
+    // Function indexes name which has just been added at the given slot.
+    void insert(const vec_s& names, ui slot) {
 
-        std::cout << std::endl;
+        if (2 * (entries + 1) > table.size())
+            rebuild(names);
+        else {
+            place(names, slot);
+            entries++;
+        }
     }
 
-    void add_to_file(const std::string& m) {
+    // Function removes slot from the index before the name is erased
+    // from names vector. Entries following it in the probe sequence
+    // are shifted back and slots behind the erased one are renumbered.
+    void erase(const vec_s& names, ui slot) {
 
-        for (auto& c : m)
-            content.push_back(c);
-    }
+        const ui mask = table.size() - 1;
+        ui       i    = home(names, slot);
 
-    void cut_from_file(ui to_cut) {
+        while (table[i] != slot + 1)
+            i = (i + 1) & mask;
 
-        if (to_cut >= content.size())
-            content.clear();
-        else
-            content.erase(content.end() - to_cut, content.end());
-    }
+        for (ui j = (i + 1) & mask; table[j]; j = (j + 1) & mask) {
 
+            ui k = home(names, table[j] - 1);
 
-    vec_c get_file_content() const {
-        return content;
-    }
+            // Entry at j may move into the hole at i if its home
+            // position does not lie cyclically within (i, j].
+            if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+                table[i] = table[j];
+                i        = j;
+            }
+        }
+
+        table[i] = 0;
+        entries--;
 
-    uint16_t get_file_mem_block() const {
-        return mem_block;
+        for (auto& e : table)
+            if (e > slot + 1)
+                e--;
     }
 
 };
 
+struct Directory {
 
-uint16_t read_uint16_t(std::ifstream& f) {
+    index_t    inode_num;     // Inode number of the directory.
+    index_t    mem_block;     // First block of the directory.
+    ui         index_bytes;   // Width of inode numbers inside entries.
+    vec_s      names;         // Name of the file
+    vec_i      inodes;        // Directly mapped onto the inode number.
+    Name_Index index;         // Slots of names.
+    length_t   encoded;       // Size of the encoded content.
 
-    char buffer[2];
-    f.read(buffer, 2);
 
-    return ((uint16_t) buffer[1] << 8) | (byte) buffer[0];
-}
+    explicit Directory(index_t inode_nr, index_t mem_block, ui index_bytes, const vec_c& dir_content):
+                      inode_num(inode_nr), mem_block(mem_block), index_bytes(index_bytes),
+                      encoded(dir_content.size()) {
 
-uint16_t read_uint16_t(const vec_c& buffer, uint16_t pos) {
-    return ((uint16_t) buffer[pos + 1] << 8) | (byte) buffer[pos];
-}
+        std::size_t read = 0;
 
-vec_c convert_to_vector(char* buffer, ui size) {
+        while (read < dir_content.size()) {
 
-    vec_c content_vec;
+            std::size_t end = read;
 
-    for (ui i = 0; i < size; i++)
-        content_vec.push_back(buffer[i]);
-	
-    delete [] buffer;
+            while (dir_content[end] != '\0')
+                end++;
 
-    return content_vec;
-}
+            names.emplace_back(dir_content.data() + read, end - read);
+            inodes.push_back(read_uint((const byte*) dir_content.data() + end + 1, index_bytes));
 
-vec_c read_string(std::ifstream& f, uint16_t size) {
+            read = end + 1 + index_bytes;
+        }
 
-    char* content = new char[size];
-    
-    f.read(content, size);
+        index.rebuild(names);
+    }
 
-    return convert_to_vector(content, size);
-}
+    void add_new_file(std::string_view s, index_t inode) {
 
-void write_uint16_t(std::ostream& f, uint16_t val) {
+        if (index.find(names, s.data(), s.size()) != names.size())
+            throw std::runtime_error("File already exists");
 
-    byte my_arr[2];
-    memcpy(my_arr, &val, sizeof(val));
+        names.emplace_back(s);
+        inodes.push_back(inode);
+        index.insert(names, names.size() - 1);
+        encoded += get_entry_size(s);
+    }
 
-    f.write( (const char*) my_arr, 2);
-}
+    index_t get_file_inode(std::string_view s) const {
 
-void write_byte(std::ofstream& f, byte val) {
-    f.put(val);
-}
+        ui idx = index.find(names, s.data(), s.size());
 
-void write_string(std::ofstream&f, const vec_c& content, uint16_t size) {
+        return idx == names.size() ? 0 : inodes[idx];
+    }
+
+    void print_content(std::ostream& out) const {
+        for (auto const & s : names)
+            out << s << '\n';
+    }
 
-    char* buffer = new char[size];
+    void erase_file(std::string_view s) {
 
-    for (uint16_t i = 0; i < size; i++)
-        buffer[i] = content[i];
+        ui idx = index.find(names, s.data(), s.size());
 
-    f.write(buffer, size);
-    
-    delete[] buffer;
-}
+        if (idx == names.size())
+            throw std::runtime_error("File not found");
 
+        encoded -= get_entry_size(s);
+        index.erase(names, idx);
+        names.erase(names.begin() + idx);
+        inodes.erase(inodes.begin() + idx);
+    }
 
-byte read_byte(std::ifstream& f) {
+    // Function gives size of the encoded directory content.
+    length_t get_encoded_size() const {
+        return encoded;
+    }
 
-    char t;
-    f.read(&t, 1);
+    // Name, its terminating zero and the inode number.
+    ui get_entry_size(std::string_view name) const {
+        return name.size() + 1 + index_bytes;
+    }
 
-    return (byte) t;
-}
+    vec_c get_directory_content() const {
 
-vec_s path(std::string& s) {
+        vec_c       content(get_encoded_size());
+        std::size_t pos = 0;
 
-    const std::string delimiter = "/";
+        for (ui i = 0; i < names.size(); i++) {
 
-    vec_s path;
-    std::size_t pos;
+            names[i].copy(content.data() + pos, names[i].size());
+            pos += names[i].size();
 
-    if (s != "/") {
-        while ((pos = s.find(delimiter)) != std::string::npos) {
-            path.push_back(s.substr(0, pos));
-            s.erase(0, pos + delimiter.length());
+            content[pos++] = '\0';
+            write_uint((byte*) content.data() + pos, inodes[i], index_bytes);
+            pos += index_bytes;
         }
+
+        return content;
     }
 
-    return path;
+};
+
+
+// Reads little-endian number stored on given amount of bytes.
+uint64_t read_uint(const byte* p, ui bytes) {
+
+    uint64_t val = 0;
+
+    for (ui i = bytes; i--; )
+        val = (val << 8) | p[i];
+
+    return val;
+}
+
+// Writes number as little-endian on given amount of bytes.
+void write_uint(byte* p, uint64_t val, ui bytes) {
+
+    for (ui i = 0; i < bytes; i++, val >>= 8)
+        p[i] = (byte) val;
 }
 
 #endif //_FILE_SYSTEM_UTILITY_H